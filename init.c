@@ -52,11 +52,16 @@ void handleOutput(char **saveptr);
 void handleError(char **saveptr);
 void handleSetID(int u, char **saveptr);
 void handleTTYRaw(char **saveptr);
+void handleFD(char **saveptr);
 void handleEnv(char **saveptr);
 void crash();
 
 unsigned int timeout = 0;
 int childI = 0, childO = 1, childE = 2;
+
+/* extra FDs for the next run (childFDFrom[i] becomes childFD[i]) */
+#define CHILD_FDS_MAX 16
+int childFD[CHILD_FDS_MAX], childFDFrom[CHILD_FDS_MAX], childFDs = 0;
 uid_t childUID = 0;
 gid_t childGID = 0;
 
@@ -154,6 +159,8 @@ int main(int argc, char **argv)
             handleSetID(0, &wsaveptr);
         } else CMD(ttyraw) {
             handleTTYRaw(&wsaveptr);
+        } else CMD(fd) {
+            handleFD(&wsaveptr);
         } else CMD(env) {
             handleEnv(&wsaveptr);
         } else {
@@ -260,6 +267,7 @@ void handleRun(int daemon, char **saveptr)
     char *ru, *dir, *cmd;
     pid_t pid, spid;
     int user;
+    int i;
 
     /* root or user? */
     SF(ru, strtok_r, NULL, (NULL, " ", saveptr));
@@ -289,6 +297,12 @@ void handleRun(int daemon, char **saveptr)
         if (childO != 1) dup2(childO, 1);
         if (childE != 2) dup2(childE, 2);
 
+        /* extra FDs, moved out of the way first so none clobbers another */
+        for (i = 0; i < childFDs; i++)
+            SF(childFDFrom[i], fcntl, -1, (childFDFrom[i], F_DUPFD, 64));
+        for (i = 0; i < childFDs; i++)
+            dup2(childFDFrom[i], childFD[i]);
+
         /* chroot */
         SF(tmpi, chdir, -1, ("/host"));
         SF(tmpi, chroot, -1, ("/host"));
@@ -320,6 +334,11 @@ void handleRun(int daemon, char **saveptr)
         while (1) sleep(60*60*24);
     }
 
+    /* extra FDs are only for the one run */
+    for (i = 0; i < childFDs; i++)
+        close(childFDFrom[i]);
+    childFDs = 0;
+
     if (!daemon) {
         /* as well as a pid to do the timeout */
         if (timeout != 0) {
@@ -423,6 +442,37 @@ void handleTTYRaw(char **saveptr)
     SF(tmpi, tcsetattr, -1, (childO, TCSANOW, &termios_p));
 }
 
+void handleFD(char **saveptr)
+{
+    char *fds, *file, *rfile;
+    struct termios termios_p;
+    int fd, tmpi;
+
+    SF(fds, strtok_r, NULL, (NULL, " ", saveptr));
+    SF(file, strtok_r, NULL, (NULL, "\n", saveptr));
+    fd = atoi(fds);
+    if (fd < 3 || childFDs == CHILD_FDS_MAX) {
+        fprintf(stderr, "Use: fd <fd from 3> <file>\n");
+        exit(1);
+    }
+
+    SF(rfile, malloc, NULL, (strlen(file) + 7));
+    sprintf(rfile, "/host/%s", file);
+
+    SF(childFDFrom[childFDs], open, -1, (rfile, O_RDWR));
+    childFD[childFDs] = fd;
+    free(rfile);
+
+    /* ttys are raw, to pass data untouched */
+    if (isatty(childFDFrom[childFDs])) {
+        SF(tmpi, tcgetattr, -1, (childFDFrom[childFDs], &termios_p));
+        cfmakeraw(&termios_p);
+        SF(tmpi, tcsetattr, -1, (childFDFrom[childFDs], TCSANOW, &termios_p));
+    }
+
+    childFDs++;
+}
+
 void handleEnv(char **saveptr)
 {
     char *var, *val;
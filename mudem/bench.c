@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* umlbox-mudem-bench: runs a pair of mudems back to back (over pipes, a
+ * UNIX socket or a shared ring), drives
+ * forwarded tcp4 and unix streams through them to an echo server, and
+ * reports throughput and round-trip latency */
+
+#define _POSIX_C_SOURCE 200809L /* for mkdtemp */
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "timer.h"
+
+BUFFER(llong, long long);
+BUFFER(charp, char *);
+BUFFER(pollfd, struct pollfd);
+
+/* a stream we drive: it sends messages and times how long each takes to
+ * come back */
+typedef struct _BenchStream BenchStream;
+struct _BenchStream {
+    int fd;
+
+    /* how much of the message being sent is written, how much of the
+     * message being echoed is back, and when each outstanding message was
+     * sent (a ring of depth entries) */
+    size_t wrote, got;
+    long long *sent;
+    int sentHead, outstanding;
+};
+
+/* a connection to our echo server */
+typedef struct _BenchEcho BenchEcho;
+struct _BenchEcho {
+    int fd;
+    char buf[65536];
+    size_t start, end;
+};
+
+/* settings */
+static const char *mudem = "./umlbox-mudem";
+static int streamCount = 8, useTCP4 = 1, useUNIX = 1, depth = 1;
+static size_t msgSize = 1024;
+static int seconds = 5, compressible = 0, channelCount = 1;
+static const char *transport = "pipe";
+
+/* each side's extra options */
+static struct Buffer_charp extraArgs[2];
+
+/* each side's options for the transports and extra channels between them */
+static struct Buffer_charp channelArgs[2];
+
+/* state */
+static char dir[] = "/tmp/umlbox-mudem-bench.XXXXXX";
+static int dirMade = 0;
+static pid_t pids[2];
+static BenchStream *streams;
+static BenchEcho **echoes;
+static int echoCount, streamTCP4, streamUNIX;
+static char *message, *scratch;
+static struct Buffer_llong rtts;
+static unsigned long long messages;
+
+static void usage()
+{
+    fprintf(stderr, "Use: umlbox-mudem-bench [options]\n"
+                    "Options:\n"
+                    "\t-m <path>: The umlbox-mudem to run (default ./umlbox-mudem).\n"
+                    "\t-p {tcp4|unix|both}: Which kind of streams to forward (default both).\n"
+                    "\t-n <count>: Concurrent streams (default 8).\n"
+                    "\t-s <bytes>: Message size (default 1024).\n"
+                    "\t-d <count>: Messages in flight per stream (default 1).\n"
+                    "\t-t <seconds>: How long to run (default 5).\n"
+                    "\t-c: Send compressible messages.\n"
+                    "\t-k <count>: Channels between the mudems (default 1).\n"
+                    "\t-T {pipe|unix|shm}: What the channels run over (default pipe).\n"
+                    "\t-x <arg>: Pass an extra option to both mudems.\n"
+                    "\t-0 <arg>, -1 <arg>: Pass an extra option to mudem 0 or 1 only\n"
+                    "\t                    (e.g. --metrics, which needs a path each).\n");
+}
+
+/* stop the mudems and remove our directory, however we exit */
+static void benchCleanup()
+{
+    struct dirent *de;
+    char path[128];
+    DIR *d;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (pids[i] <= 0) continue;
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+        pids[i] = 0;
+    }
+
+    if (!dirMade) return;
+    dirMade = 0;
+    d = opendir(dir);
+    if (d) {
+        while ((de = readdir(d))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void setNonBlocking(int fd)
+{
+    int flags, tmpi;
+    SF(flags, fcntl, -1, (fd, F_GETFL, 0));
+    SF(tmpi, fcntl, -1, (fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+/* make a listening socket, either TCP on localhost (with port filled in) or
+ * UNIX at path */
+static int benchListen(int isUNIX, const char *path, int *port)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_un sun;
+    socklen_t len;
+    int fd, tmpi;
+
+    if (isUNIX) {
+        SF(fd, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+        SF(tmpi, bind, -1, (fd, (struct sockaddr *) &sun, sizeof(sun)));
+
+    } else {
+        SF(fd, socket, -1, (AF_INET, SOCK_STREAM, 0));
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        SF(tmpi, bind, -1, (fd, (struct sockaddr *) &sin, sizeof(sin)));
+        len = sizeof(sin);
+        SF(tmpi, getsockname, -1, (fd, (struct sockaddr *) &sin, &len));
+        *port = ntohs(sin.sin_port);
+
+    }
+
+    SF(tmpi, listen, -1, (fd, 128));
+    return fd;
+}
+
+/* connect to a forwarded socket, retrying until mudem is listening */
+static int benchConnect(int isUNIX, const char *path, int port)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_un sun;
+    struct sockaddr *addr;
+    socklen_t len;
+    long long giveUp = timerNow() + 5000000;
+    struct timespec retry = {0, 10000000};
+    int fd;
+
+    if (isUNIX) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+        addr = (struct sockaddr *) &sun;
+        len = sizeof(sun);
+    } else {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(port);
+        addr = (struct sockaddr *) &sin;
+        len = sizeof(sin);
+    }
+
+    while (1) {
+        SF(fd, socket, -1, (isUNIX ? AF_UNIX : AF_INET, SOCK_STREAM, 0));
+        if (connect(fd, addr, len) == 0) break;
+        close(fd);
+        if (timerNow() > giveUp) {
+            fprintf(stderr, "Couldn't connect to the forwarded %s socket.\n",
+                    isUNIX ? "unix" : "tcp4");
+            exit(1);
+        }
+        nanosleep(&retry, NULL);
+    }
+
+    setNonBlocking(fd);
+    return fd;
+}
+
+/* start one mudem, reading from in and writing to out (or, if they're -1,
+ * leaving them be) */
+static pid_t benchSpawn(int side, int in, int out, char *spec1, char *spec2)
+{
+    struct Buffer_charp args;
+    char sideArg[2];
+    pid_t pid;
+    int i;
+
+    INIT_BUFFER(args);
+    WRITE_ONE_BUFFER(args, (char *) mudem);
+    for (i = 0; i < extraArgs[side].bufused; i++)
+        WRITE_ONE_BUFFER(args, extraArgs[side].buf[i]);
+    for (i = 0; i < channelArgs[side].bufused; i++)
+        WRITE_ONE_BUFFER(args, channelArgs[side].buf[i]);
+    sideArg[0] = '0' + side;
+    sideArg[1] = '\0';
+    WRITE_ONE_BUFFER(args, sideArg);
+    if (spec1) WRITE_ONE_BUFFER(args, spec1);
+    if (spec2) WRITE_ONE_BUFFER(args, spec2);
+    WRITE_ONE_BUFFER(args, NULL);
+
+    SF(pid, fork, -1, ());
+    if (pid == 0) {
+        if (in >= 0) dup2(in, 0);
+        if (out >= 0) dup2(out, 1);
+        execv(mudem, args.buf);
+        perror(mudem);
+        _exit(1);
+    }
+
+    FREE_BUFFER(args);
+    return pid;
+}
+
+/* accept a connection to the echo server */
+static void echoAccept(int lfd)
+{
+    BenchEcho *echo;
+    int fd;
+
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0) return;
+    setNonBlocking(fd);
+
+    SF(echo, malloc, NULL, (sizeof(BenchEcho)));
+    echo->fd = fd;
+    echo->start = echo->end = 0;
+    SF(echoes, realloc, NULL, (echoes, (echoCount + 1) * sizeof(BenchEcho *)));
+    echoes[echoCount++] = echo;
+}
+
+/* echo whatever we can */
+static void echoRun(BenchEcho *echo, short revents)
+{
+    ssize_t rd, wr;
+
+    if ((revents & (POLLIN|POLLHUP|POLLERR)) && echo->end < sizeof(echo->buf)) {
+        rd = read(echo->fd, echo->buf + echo->end, sizeof(echo->buf) - echo->end);
+        if (rd > 0) echo->end += rd;
+    }
+
+    if (echo->start < echo->end) {
+        wr = write(echo->fd, echo->buf + echo->start, echo->end - echo->start);
+        if (wr > 0) echo->start += wr;
+        if (echo->start == echo->end) echo->start = echo->end = 0;
+    }
+}
+
+/* send what we can and collect what's come back on a stream */
+static void streamRun(BenchStream *stream, short revents, int counting)
+{
+    ssize_t rd, wr;
+    long long now;
+    int tail;
+
+    /* send more, while we may have more in flight */
+    while (stream->outstanding < depth || stream->wrote) {
+        wr = write(stream->fd, message + stream->wrote, msgSize - stream->wrote);
+        if (wr <= 0) break;
+        if (stream->wrote == 0)
+            stream->sent[(stream->sentHead + stream->outstanding++) % depth] = timerNow();
+        stream->wrote += wr;
+        if (stream->wrote == msgSize) stream->wrote = 0;
+    }
+
+    if (!(revents & (POLLIN|POLLHUP|POLLERR))) return;
+
+    rd = read(stream->fd, scratch, msgSize);
+    if (rd == 0) {
+        fprintf(stderr, "A forwarded stream was closed!\n");
+        exit(1);
+    }
+    if (rd < 0) return;
+
+    /* every message that's now completely back is timed */
+    stream->got += rd;
+    now = timerNow();
+    while (stream->got >= msgSize && stream->outstanding) {
+        stream->got -= msgSize;
+        tail = stream->sentHead;
+        stream->sentHead = (stream->sentHead + 1) % depth;
+        stream->outstanding--;
+        if (counting) {
+            WRITE_ONE_BUFFER(rtts, now - stream->sent[tail]);
+            messages++;
+        }
+    }
+}
+
+static int llongCmp(const void *l, const void *r)
+{
+    long long a = *(const long long *) l, b = *(const long long *) r;
+    return (a > b) - (a < b);
+}
+
+int main(int argc, char **argv)
+{
+    char *dirp;
+    char echoPath[64], listenPath[64];
+    char tcp4Spec0[64], tcp4Spec1[64], unixSpec0[96], unixSpec1[96];
+    int tcp4Echo = -1, unixEcho = -1, echoPort, listenPort = 0, tmpi, i, opt;
+    int pipe01[2], pipe10[2];
+    struct Buffer_int channelFds;
+    char *arg;
+    struct Buffer_pollfd pfds;
+    long long start, end, now;
+    double elapsed;
+    size_t s;
+
+    INIT_BUFFER(extraArgs[0]);
+    INIT_BUFFER(extraArgs[1]);
+    while ((opt = getopt(argc, argv, "m:p:n:s:d:t:ck:T:x:0:1:")) != -1) {
+        switch (opt) {
+            case 'm': mudem = optarg; break;
+            case 'p':
+                useTCP4 = strcmp(optarg, "unix") != 0;
+                useUNIX = strcmp(optarg, "tcp4") != 0;
+                break;
+            case 'n': streamCount = atoi(optarg); break;
+            case 's': msgSize = strtoul(optarg, NULL, 10); break;
+            case 'd': depth = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'c': compressible = 1; break;
+            case 'k': channelCount = atoi(optarg); break;
+            case 'T': transport = optarg; break;
+            case 'x':
+                WRITE_ONE_BUFFER(extraArgs[0], optarg);
+                WRITE_ONE_BUFFER(extraArgs[1], optarg);
+                break;
+            case '0': WRITE_ONE_BUFFER(extraArgs[0], optarg); break;
+            case '1': WRITE_ONE_BUFFER(extraArgs[1], optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (streamCount < 1 || msgSize < 1 || depth < 1 || seconds < 1 ||
+        channelCount < 1 || (strcmp(transport, "pipe") &&
+                             strcmp(transport, "unix") && strcmp(transport, "shm"))) {
+        usage();
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* make our messages */
+    SF(message, malloc, NULL, (msgSize));
+    SF(scratch, malloc, NULL, (msgSize));
+    srand(1);
+    for (s = 0; s < msgSize; s++)
+        message[s] = compressible ? "mudem bench text, "[s % 18] : rand();
+
+    /* the echo servers the other side connects to */
+    SF(dirp, mkdtemp, NULL, (dir));
+    dirMade = 1;
+    atexit(benchCleanup);
+    snprintf(echoPath, sizeof(echoPath), "%s/echo", dir);
+    snprintf(listenPath, sizeof(listenPath), "%s/listen", dir);
+    if (useTCP4) {
+        tcp4Echo = benchListen(0, NULL, &echoPort);
+
+        /* find a free port for mudem to listen on */
+        tmpi = benchListen(0, NULL, &listenPort);
+        close(tmpi);
+
+        snprintf(tcp4Spec0, sizeof(tcp4Spec0), "tcp4-listen:%d", listenPort);
+        snprintf(tcp4Spec1, sizeof(tcp4Spec1), "tcp4:127.0.0.1:%d", echoPort);
+    }
+    if (useUNIX) {
+        unixEcho = benchListen(1, echoPath, NULL);
+        snprintf(unixSpec0, sizeof(unixSpec0), "unix-listen:%s", listenPath);
+        snprintf(unixSpec1, sizeof(unixSpec1), "unix:%s", echoPath);
+    }
+
+    /* the mudems, back to back, over as many channels as we were asked */
+    INIT_BUFFER(channelArgs[0]);
+    INIT_BUFFER(channelArgs[1]);
+    INIT_BUFFER(channelFds);
+    for (i = 0; strcmp(transport, "pipe") && i < channelCount; i++) {
+        /* named transports live in our directory */
+        for (tmpi = 0; tmpi < 2; tmpi++) {
+            SF(arg, malloc, NULL, (128));
+            snprintf(arg, 128, "--%s=%s%s:%s/mux%d", i ? "channel" : "transport",
+                     transport, (tmpi == 0 && !strcmp(transport, "unix")) ? "-listen" : "",
+                     dir, i);
+            WRITE_ONE_BUFFER(channelArgs[tmpi], arg);
+        }
+    }
+    for (i = 1; !strcmp(transport, "pipe") && i < channelCount; i++) {
+        SF(tmpi, pipe, -1, (pipe01));
+        SF(tmpi, pipe, -1, (pipe10));
+        SF(arg, malloc, NULL, (32));
+        snprintf(arg, 32, "--channel=%d,%d", pipe10[0], pipe01[1]);
+        WRITE_ONE_BUFFER(channelArgs[0], arg);
+        SF(arg, malloc, NULL, (32));
+        snprintf(arg, 32, "--channel=%d,%d", pipe01[0], pipe10[1]);
+        WRITE_ONE_BUFFER(channelArgs[1], arg);
+        WRITE_BUFFER(channelFds, pipe01, 2);
+        WRITE_BUFFER(channelFds, pipe10, 2);
+    }
+    if (!strcmp(transport, "pipe")) {
+        SF(tmpi, pipe, -1, (pipe01));
+        SF(tmpi, pipe, -1, (pipe10));
+        WRITE_BUFFER(channelFds, pipe01, 2);
+        WRITE_BUFFER(channelFds, pipe10, 2);
+    } else {
+        pipe01[0] = pipe01[1] = pipe10[0] = pipe10[1] = -1;
+    }
+    pids[0] = benchSpawn(0, pipe10[0], pipe01[1], useTCP4 ? tcp4Spec0 : NULL,
+                         useUNIX ? unixSpec0 : NULL);
+    pids[1] = benchSpawn(1, pipe01[0], pipe10[1], useTCP4 ? tcp4Spec1 : NULL,
+                         useUNIX ? unixSpec1 : NULL);
+    for (i = 0; i < channelFds.bufused; i++)
+        close(channelFds.buf[i]);
+
+    /* our streams, alternating kinds */
+    SF(streams, calloc, NULL, (streamCount, sizeof(BenchStream)));
+    for (i = 0; i < streamCount; i++) {
+        int isUNIX = !useTCP4 || (useUNIX && i % 2);
+        streams[i].fd = benchConnect(isUNIX, listenPath, listenPort);
+        SF(streams[i].sent, malloc, NULL, (depth * sizeof(long long)));
+        if (isUNIX) streamUNIX++;
+        else streamTCP4++;
+    }
+
+    /* then run them */
+    INIT_BUFFER(pfds);
+    INIT_BUFFER(rtts);
+    start = timerNow();
+    end = start + (long long) seconds * 1000000;
+    while ((now = timerNow()) < end) {
+        pfds.bufused = 0;
+        for (i = 0; i < streamCount; i++) {
+            struct pollfd pfd;
+            pfd.fd = streams[i].fd;
+            pfd.events = POLLIN;
+            if (streams[i].outstanding < depth || streams[i].wrote)
+                pfd.events |= POLLOUT;
+            WRITE_ONE_BUFFER(pfds, pfd);
+        }
+        for (i = 0; i < echoCount; i++) {
+            struct pollfd pfd;
+            pfd.fd = echoes[i]->fd;
+            pfd.events = 0;
+            if (echoes[i]->end < sizeof(echoes[i]->buf)) pfd.events |= POLLIN;
+            if (echoes[i]->start < echoes[i]->end) pfd.events |= POLLOUT;
+            WRITE_ONE_BUFFER(pfds, pfd);
+        }
+        for (i = 0; i < 2; i++) {
+            struct pollfd pfd;
+            pfd.fd = i ? unixEcho : tcp4Echo;
+            pfd.events = POLLIN;
+            WRITE_ONE_BUFFER(pfds, pfd);
+        }
+
+        tmpi = poll(pfds.buf, pfds.bufused, (end - now) / 1000 + 1);
+        if (tmpi < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        if (tmpi <= 0) continue;
+
+        for (i = 0; i < streamCount; i++)
+            streamRun(&streams[i], pfds.buf[i].revents, 1);
+        for (i = 0; i < echoCount; i++)
+            echoRun(echoes[i], pfds.buf[streamCount + i].revents);
+        for (i = 0; i < 2; i++) {
+            if (pfds.buf[streamCount + echoCount + i].revents & POLLIN)
+                echoAccept(i ? unixEcho : tcp4Echo);
+        }
+    }
+    elapsed = (timerNow() - start) / 1000000.0;
+
+    /* report */
+    printf("transport: %s, %d channel%s\n", transport, channelCount,
+           (channelCount == 1) ? "" : "s");
+    printf("streams: %d (tcp4 %d, unix %d), message %lu bytes, %d in flight each\n",
+           streamCount, streamTCP4, streamUNIX, (unsigned long) msgSize, depth);
+    printf("throughput: %.1f MB/s, %.0f messages/s\n",
+           messages * msgSize / elapsed / 1000000.0, messages / elapsed);
+    if (rtts.bufused) {
+        qsort(rtts.buf, rtts.bufused, sizeof(long long), llongCmp);
+        printf("round trip: p50 %lld us, p99 %lld us\n",
+               rtts.buf[rtts.bufused / 2], rtts.buf[rtts.bufused * 99 / 100]);
+    }
+
+    /* (and clean up on the way out) */
+    return 0;
+}
@@ -130,6 +130,16 @@ BUFFER(int, int);
 
 #endif
 
+/* halve a buffer if it's no more than a quarter used, though never below the
+ * default size (not for use with GGGGC) */
+#define SHRINK_BUFFER(buffer) \
+{ \
+    if ((buffer).bufsz > BUFFER_DEFAULT_SIZE && (buffer).bufused <= (buffer).bufsz / 4) { \
+        (buffer).bufsz /= 2; \
+        SF((buffer).buf, _BUFFER_REALLOC, NULL, ((buffer).buf, (buffer).bufsz * sizeof(*(buffer).buf))); \
+    } \
+}
+
 /* write a string to a buffer */
 #define WRITE_BUFFER(buffer, string, len) \
 { \
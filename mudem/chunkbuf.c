@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "chunkbuf.h"
+#include "helpers.h"
+#include "slab.h"
+
+/* get a fresh, empty chunk */
+static Chunk *newChunk()
+{
+    Chunk *ret = (Chunk *) slabAlloc(CHUNK_ALLOC_SIZE);
+    ret->next = NULL;
+    ret->start = ret->end = 0;
+    return ret;
+}
+
+/* release a chunk */
+static void releaseChunk(Chunk *chunk)
+{
+    slabFree(chunk, CHUNK_ALLOC_SIZE);
+}
+
+/* release a whole list of chunks */
+static void releaseChunks(Chunk *chunk)
+{
+    Chunk *next;
+    for (; chunk; chunk = next) {
+        next = chunk->next;
+        releaseChunk(chunk);
+    }
+}
+
+/* add a chunk to the end of a buffer */
+static void appendChunk(struct ChunkBuffer *cb, Chunk *chunk)
+{
+    chunk->next = NULL;
+    if (cb->tail)
+        cb->tail->next = chunk;
+    else
+        cb->head = chunk;
+    cb->tail = chunk;
+}
+
+/* initialize a chunk buffer (allocates nothing) */
+void initChunkBuffer(struct ChunkBuffer *cb)
+{
+    cb->head = cb->tail = cb->spare = NULL;
+    cb->used = 0;
+}
+
+/* free all of a chunk buffer's chunks */
+void freeChunkBuffer(struct ChunkBuffer *cb)
+{
+    releaseChunks(cb->head);
+    releaseChunks(cb->spare);
+    initChunkBuffer(cb);
+}
+
+/* append data to a chunk buffer */
+void chunkBufferWrite(struct ChunkBuffer *cb, const void *buf, size_t count)
+{
+    const char *cbuf = (const char *) buf;
+    size_t part;
+
+    cb->used += count;
+
+    while (count) {
+        /* make sure there's room in the tail */
+        if (!cb->tail || cb->tail->end == CHUNK_DATA_SIZE)
+            appendChunk(cb, newChunk());
+
+        /* and fill it */
+        part = CHUNK_DATA_SIZE - cb->tail->end;
+        if (part > count) part = count;
+        memcpy(cb->tail->data + cb->tail->end, cbuf, part);
+        cb->tail->end += part;
+        cbuf += part;
+        count -= part;
+    }
+}
+
+/* get up to count bytes of space at the end of a chunk buffer to fill in
+ * directly, as at most iovmax iovecs. Returns the number of iovecs used. The
+ * space becomes part of the buffer only once chunkBufferCommit is called */
+int chunkBufferSpace(struct ChunkBuffer *cb, struct iovec *iov, int iovmax, size_t count)
+{
+    Chunk *chunk, **link;
+    size_t part;
+    int iovcnt;
+
+    iovcnt = 0;
+
+    /* first whatever is left in the tail */
+    if (cb->tail && cb->tail->end < CHUNK_DATA_SIZE && count) {
+        part = CHUNK_DATA_SIZE - cb->tail->end;
+        if (part > count) part = count;
+        iov[iovcnt].iov_base = cb->tail->data + cb->tail->end;
+        iov[iovcnt].iov_len = part;
+        iovcnt++;
+        count -= part;
+    }
+
+    /* then spare chunks, getting more as needed */
+    link = &cb->spare;
+    while (count && iovcnt < iovmax) {
+        if (!*link) *link = newChunk();
+        chunk = *link;
+        part = CHUNK_DATA_SIZE;
+        if (part > count) part = count;
+        iov[iovcnt].iov_base = chunk->data;
+        iov[iovcnt].iov_len = part;
+        iovcnt++;
+        count -= part;
+        link = &chunk->next;
+    }
+
+    return iovcnt;
+}
+
+/* commit count bytes of the space from chunkBufferSpace (which may be 0) */
+void chunkBufferCommit(struct ChunkBuffer *cb, size_t count)
+{
+    Chunk *chunk;
+    size_t part;
+
+    cb->used += count;
+
+    /* fill the tail */
+    if (cb->tail) {
+        part = CHUNK_DATA_SIZE - cb->tail->end;
+        if (part > count) part = count;
+        cb->tail->end += part;
+        count -= part;
+    }
+
+    /* then move filled spares into the buffer */
+    while (count) {
+        chunk = cb->spare;
+        cb->spare = chunk->next;
+        part = CHUNK_DATA_SIZE;
+        if (part > count) part = count;
+        chunk->end = part;
+        count -= part;
+        appendChunk(cb, chunk);
+    }
+
+    /* and give back the rest */
+    releaseChunks(cb->spare);
+    cb->spare = NULL;
+}
+
+/* move count bytes from the start of one chunk buffer to the end of another,
+ * handing over whole chunks where possible rather than copying */
+void chunkBufferMove(struct ChunkBuffer *cb, struct ChunkBuffer *from, size_t count)
+{
+    Chunk *chunk;
+    size_t part;
+
+    while (count) {
+        chunk = from->head;
+        part = chunk->end - chunk->start;
+
+        if (part <= count) {
+            /* take the whole chunk */
+            from->head = chunk->next;
+            if (!from->head) from->tail = NULL;
+            from->used -= part;
+            appendChunk(cb, chunk);
+            cb->used += part;
+            count -= part;
+
+        } else {
+            /* copy the part we need */
+            chunkBufferWrite(cb, chunk->data + chunk->start, count);
+            chunk->start += count;
+            from->used -= count;
+            count = 0;
+
+        }
+    }
+}
+
+/* copy count bytes out of the start of a chunk buffer, consuming them */
+void chunkBufferRead(struct ChunkBuffer *cb, void *buf, size_t count)
+{
+    char *cbuf = (char *) buf;
+    Chunk *chunk;
+    size_t part;
+
+    cb->used -= count;
+    while (count) {
+        chunk = cb->head;
+        part = chunk->end - chunk->start;
+        if (part > count) part = count;
+        memcpy(cbuf, chunk->data + chunk->start, part);
+        chunk->start += part;
+        cbuf += part;
+        count -= part;
+
+        if (chunk->start == chunk->end) {
+            cb->head = chunk->next;
+            if (!cb->head) cb->tail = NULL;
+            releaseChunk(chunk);
+        }
+    }
+}
+
+/* describe (up to iovmax of) the chunks at the start of a chunk buffer as
+ * iovecs, returning the number used */
+int chunkBufferIov(struct ChunkBuffer *cb, struct iovec *iov, int iovmax)
+{
+    Chunk *chunk;
+    int iovcnt = 0;
+
+    for (chunk = cb->head; chunk && iovcnt < iovmax; chunk = chunk->next) {
+        iov[iovcnt].iov_base = chunk->data + chunk->start;
+        iov[iovcnt].iov_len = chunk->end - chunk->start;
+        iovcnt++;
+    }
+
+    return iovcnt;
+}
+
+/* discard count bytes from the start of a chunk buffer (once written),
+ * releasing fully written chunks */
+void chunkBufferSkip(struct ChunkBuffer *cb, size_t count)
+{
+    Chunk *chunk;
+    size_t part;
+
+    cb->used -= count;
+    while (count) {
+        chunk = cb->head;
+        part = chunk->end - chunk->start;
+        if (part > count) {
+            chunk->start += count;
+            break;
+        }
+        count -= part;
+        cb->head = chunk->next;
+        releaseChunk(chunk);
+    }
+    if (!cb->head) cb->tail = NULL;
+}
+
+/* write as much of the chunk buffer as possible to an FD with writev,
+ * releasing fully written chunks. Returns the writev result */
+ssize_t chunkBufferWriteFd(struct ChunkBuffer *cb, int fd)
+{
+    struct iovec iov[CHUNK_IOV_MAX];
+    ssize_t wrote;
+    int iovcnt;
+
+    iovcnt = chunkBufferIov(cb, iov, CHUNK_IOV_MAX);
+    if (iovcnt == 0) return 0;
+
+    wrote = writev(fd, iov, iovcnt);
+    if (wrote <= 0) return wrote;
+
+    chunkBufferSkip(cb, wrote);
+    return wrote;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CHUNKBUF_H
+#define CHUNKBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* size of each chunk allocation, header included (one of the slab size
+ * classes, so chunks are recycled through the slabs) */
+#define CHUNK_ALLOC_SIZE 4096
+
+/* maximum number of chunks handed to a single writev */
+#define CHUNK_IOV_MAX 64
+
+typedef struct _Chunk Chunk;
+
+/* a single fixed-size piece of a chunk buffer. The pending bytes are
+ * data[start..end) */
+struct _Chunk {
+    Chunk *next;
+    size_t start, end;
+    char data[1];
+};
+
+/* how much data fits in a chunk */
+#define CHUNK_DATA_SIZE (CHUNK_ALLOC_SIZE - offsetof(Chunk, data))
+
+/* a write buffer made of a chain of chunks. Bytes are never moved once
+ * written into a chunk; drained chunks are simply released */
+struct ChunkBuffer {
+    Chunk *head, *tail;
+    size_t used;
+
+    /* chunks handed out by chunkBufferSpace but not yet committed */
+    Chunk *spare;
+};
+
+/* initialize a chunk buffer (allocates nothing) */
+void initChunkBuffer(struct ChunkBuffer *cb);
+
+/* free all of a chunk buffer's chunks */
+void freeChunkBuffer(struct ChunkBuffer *cb);
+
+/* append data to a chunk buffer */
+void chunkBufferWrite(struct ChunkBuffer *cb, const void *buf, size_t count);
+
+/* get up to count bytes of space at the end of a chunk buffer to fill in
+ * directly, as at most iovmax iovecs. Returns the number of iovecs used. The
+ * space becomes part of the buffer only once chunkBufferCommit is called */
+int chunkBufferSpace(struct ChunkBuffer *cb, struct iovec *iov, int iovmax, size_t count);
+
+/* commit count bytes of the space from chunkBufferSpace (which may be 0) */
+void chunkBufferCommit(struct ChunkBuffer *cb, size_t count);
+
+/* move count bytes from the start of one chunk buffer to the end of another,
+ * handing over whole chunks where possible rather than copying */
+void chunkBufferMove(struct ChunkBuffer *cb, struct ChunkBuffer *from, size_t count);
+
+/* copy count bytes out of the start of a chunk buffer, consuming them */
+void chunkBufferRead(struct ChunkBuffer *cb, void *buf, size_t count);
+
+/* describe (up to iovmax of) the chunks at the start of a chunk buffer as
+ * iovecs, returning the number used */
+int chunkBufferIov(struct ChunkBuffer *cb, struct iovec *iov, int iovmax);
+
+/* discard count bytes from the start of a chunk buffer (once written),
+ * releasing fully written chunks */
+void chunkBufferSkip(struct ChunkBuffer *cb, size_t count);
+
+/* write as much of the chunk buffer as possible to an FD with writev,
+ * releasing fully written chunks. Returns the writev result */
+ssize_t chunkBufferWriteFd(struct ChunkBuffer *cb, int fd);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "connpool.h"
+#include "helpers.h"
+#include "muxstdio.h"
+#include "timer.h"
+
+/* a socket's pool: the IDs of its pooled connections, and when each was
+ * made, oldest first */
+typedef struct _ConnPool ConnPool;
+struct _ConnPool {
+    ConnPool *next;
+    Socket *owner;
+    int *ids;
+    long long *made;
+    int count;
+
+    /* fills the pool, and checks on it */
+    Timer timer;
+};
+
+/* every pool */
+static ConnPool *pools = NULL;
+
+/* statistics: connections served from a pool and made for want of one, and
+ * pooled connections closed as dead or idle */
+static unsigned long long poolHits, poolMisses, poolDead, poolExpired;
+
+static void connPoolFire(Timer *timer);
+
+/* keep a pool of connections for a socket */
+void connPoolInit(Socket *owner)
+{
+    ConnPool *pool;
+
+    SF(pool, malloc, NULL, (sizeof(ConnPool)));
+    pool->owner = owner;
+    SF(pool->ids, malloc, NULL, (owner->opts.pool * sizeof(int)));
+    SF(pool->made, malloc, NULL, (owner->opts.pool * sizeof(long long)));
+    pool->count = 0;
+    initTimer(&pool->timer, connPoolFire);
+
+    pool->next = pools;
+    pools = pool;
+
+    /* it has no ID yet, so fill it once the loop is running */
+    timerSet(&pool->timer, 1);
+}
+
+static ConnPool *connPoolOf(Socket *owner)
+{
+    ConnPool *pool;
+    for (pool = pools; pool && pool->owner != owner; pool = pool->next);
+    return pool;
+}
+
+/* get a pooled connection by its place in the pool, or NULL if it's been
+ * closed (because it failed to connect) */
+static Socket *connPoolGet(ConnPool *pool, int i)
+{
+    Socket *sock = socketById(pool->ids[i]);
+    if (sock && sock->local && sock->parentId == pool->owner->id)
+        return sock;
+    return NULL;
+}
+
+/* take a connection out of the pool */
+static void connPoolRemove(ConnPool *pool, int i)
+{
+    pool->count--;
+    memmove(pool->ids + i, pool->ids + i + 1, (pool->count - i) * sizeof(int));
+    memmove(pool->made + i, pool->made + i + 1, (pool->count - i) * sizeof(long long));
+}
+
+/* is a pooled connection still usable? It's unread, so anything but the
+ * other end closing it (or an error) is fine, including it still
+ * connecting */
+static int connPoolHealthy(Socket *sock)
+{
+    char c;
+    ssize_t rd;
+
+    rd = recv(((SocketWritable *) sock)->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (rd >= 0) return rd > 0;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN ||
+           errno == EINTR;
+}
+
+/* close anything dead or idle too long, then top the pool up */
+static void connPoolFire(Timer *timer)
+{
+    ConnPool *pool = (ConnPool *) ((char *) timer - offsetof(ConnPool, timer));
+    Socket *owner = pool->owner, *sock;
+    long long now = timerNow(), idle, next;
+    int i;
+
+    idle = (long long) owner->opts.poolIdle * 1000000;
+    for (i = 0; i < pool->count; ) {
+        sock = connPoolGet(pool, i);
+        if (sock && now - pool->made[i] < idle && connPoolHealthy(sock)) {
+            i++;
+            continue;
+        }
+        if (sock) {
+            if (now - pool->made[i] >= idle) poolExpired++;
+            else poolDead++;
+            forgetSocket(sock);
+        } else {
+            poolDead++;
+        }
+        connPoolRemove(pool, i);
+    }
+
+    while (pool->count < owner->opts.pool) {
+        sock = owner->vtbl->connect(owner);
+        if (!sock) break;
+
+        /* it's ours until it's used, and reads nothing */
+        sock->opts = owner->opts;
+        sock->name = owner->name;
+        sock->local = 1;
+        sock->parentId = owner->id;
+        sock->credit = 0;
+        pool->ids[pool->count] = registerSocket(sock, NULL);
+        pool->made[pool->count++] = now;
+    }
+
+    /* check again when the oldest would expire, or sooner */
+    next = now + CONNPOOL_CHECK * 1000000LL;
+    if (pool->count && pool->made[0] + idle < next) next = pool->made[0] + idle;
+    timerSet(&pool->timer, next);
+}
+
+/* make a connection from a socket, from its pool if it can */
+Socket *connPoolConnect(Socket *owner)
+{
+    ConnPool *pool = owner->opts.pool ? connPoolOf(owner) : NULL;
+    Socket *sock;
+
+    if (!pool) return owner->vtbl->connect(owner);
+
+    /* the oldest healthy connection is the one to use */
+    while (pool->count) {
+        sock = connPoolGet(pool, 0);
+        if (sock && !connPoolHealthy(sock)) {
+            forgetSocket(sock);
+            sock = NULL;
+        }
+        connPoolRemove(pool, 0);
+        if (!sock) {
+            poolDead++;
+            continue;
+        }
+
+        /* it becomes an ordinary connection (once it's registered again,
+         * under the ID the other side gave it) */
+        unregisterSocket(sock);
+        sock->local = 0;
+        sock->credit = muxPeerWindow;
+        poolHits++;
+
+        /* and is replaced at the end of this wakeup */
+        timerSet(&pool->timer, 1);
+        return sock;
+    }
+
+    poolMisses++;
+    timerSet(&pool->timer, 1);
+    return owner->vtbl->connect(owner);
+}
+
+/* write out statistics (in Prometheus' text format) */
+void connPoolStats(FILE *to)
+{
+    ConnPool *pool;
+    int pooled = 0;
+
+    for (pool = pools; pool; pool = pool->next)
+        pooled += pool->count;
+
+    fprintf(to, "# HELP mudem_pool_hits_total Connections served from a pool.\n"
+                "# TYPE mudem_pool_hits_total counter\n"
+                "mudem_pool_hits_total %llu\n"
+                "# HELP mudem_pool_misses_total Connections made because a pool was empty.\n"
+                "# TYPE mudem_pool_misses_total counter\n"
+                "mudem_pool_misses_total %llu\n"
+                "# HELP mudem_pool_dead_total Pooled connections found closed or failed.\n"
+                "# TYPE mudem_pool_dead_total counter\n"
+                "mudem_pool_dead_total %llu\n"
+                "# HELP mudem_pool_expired_total Pooled connections closed for being idle too long.\n"
+                "# TYPE mudem_pool_expired_total counter\n"
+                "mudem_pool_expired_total %llu\n"
+                "# HELP mudem_pool_connections Connections waiting in pools.\n"
+                "# TYPE mudem_pool_connections gauge\n"
+                "mudem_pool_connections %d\n",
+            poolHits, poolMisses, poolDead, poolExpired, pooled);
+}
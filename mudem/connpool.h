@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <stdio.h>
+
+#include "muxsocket.h"
+
+/* the largest pool a socket may have */
+#define CONNPOOL_MAX 256
+
+/* how often pooled connections are checked on (in seconds), at most */
+#define CONNPOOL_CHECK 5
+
+/* keep a pool of connections made ahead of time from a socket (per its
+ * pool= and pool-idle= options), starting once it's registered. Pooled
+ * connections are our own sockets, unread, until they're used */
+void connPoolInit(Socket *owner);
+
+/* make a connection from a socket: a healthy one from its pool if it has
+ * one, otherwise a new one. Returns NULL on failure */
+Socket *connPoolConnect(Socket *owner);
+
+/* write out statistics */
+void connPoolStats(FILE *to);
+
+#endif
@@ -42,7 +42,7 @@ struct _SocketGenFD {
 static Socket *genfdcConnect(Socket *self);
 
 static SocketVTbl genfdcVTbl = {
-    NULL, genfdcConnect, NULL, NULL, NULL, NULL
+    NULL, genfdcConnect, NULL, NULL, NULL, NULL, NULL, NULL
 };
 
 /* vtbl for GenFD */
@@ -50,11 +50,12 @@ void socketGenFDShouldSelect(Socket *self, int *r, int *w);
 
 static SocketVTbl genfdVTbl = {
     socketWritableDestruct, NULL, socketGenFDShouldSelect, socketSelectedR,
-    socketWritableSelectedW, socketWritableWrite
+    socketWritableSelectedW, socketWritableWrite, socketWritableWriteSpace,
+    socketWritableWriteCommit
 };
 
 /* GenFDC nameable */
-static Socket *newGenFDC(char **saveptr);
+static Socket *newGenFDC(char **saveptr, SocketOptions *opts);
 static NameableSocket genfdcN = {
     NULL, "genfd", newGenFDC
 };
@@ -77,7 +78,7 @@ static Socket *genfdcConnect(Socket *self)
 }
 
 /* create a new named GenFDC */
-static Socket *newGenFDC(char **saveptr)
+static Socket *newGenFDC(char **saveptr, SocketOptions *opts)
 {
     SocketGenFDC *ret;
     char *ins, *outs;
@@ -103,7 +104,8 @@ static Socket *newGenFDC(char **saveptr)
 void socketGenFDShouldSelect(Socket *self, int *r, int *w)
 {
     socketWritableShouldSelect(self, r, w);
-    *r = ((SocketGenFD *) self)->infd;
+    if (socketMayRead(self))
+        *r = ((SocketGenFD *) self)->infd;
 }
 
 /* initializer for this whole mess */
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* the format requires the last 5 bytes to be literals, and the last match to
+ * start at least 12 bytes before the end */
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lzHash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* write an extended length (the part past 15) */
+static unsigned char *lzLength(unsigned char *op, unsigned char *oend, size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+/* write one sequence: literals, then (if mlen) a match */
+static unsigned char *lzSequence(unsigned char *op, unsigned char *oend,
+                                 const unsigned char *lit, size_t llen,
+                                 size_t offset, size_t mlen)
+{
+    unsigned char *token;
+
+    if (op >= oend) return NULL;
+    token = op++;
+    *token = (unsigned char) ((llen >= 15 ? 15 : llen) << 4);
+    if (llen >= 15 && !(op = lzLength(op, oend, llen - 15))) return NULL;
+
+    if ((size_t) (oend - op) < llen) return NULL;
+    memcpy(op, lit, llen);
+    op += llen;
+
+    if (mlen) {
+        if (oend - op < 2) return NULL;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        mlen -= LZ_MIN_MATCH;
+        *token |= (mlen >= 15 ? 15 : mlen);
+        if (mlen >= 15 && !(op = lzLength(op, oend, mlen - 15))) return NULL;
+    }
+
+    return op;
+}
+
+/* compress count bytes into at most cap bytes, returning the compressed size,
+ * or 0 if it didn't fit */
+size_t lzCompress(const unsigned char *src, size_t count, unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS]; /* position + 1 of the last match
+                                        * candidate, 0 for none */
+    unsigned char *op = dst, *oend = dst + cap;
+    size_t ip, anchor, ref, mlen, limit;
+    uint32_t seq, h;
+
+    memset(table, 0, sizeof(table));
+    ip = anchor = 0;
+    limit = (count > LZ_MF_LIMIT) ? count - LZ_MF_LIMIT : 0;
+
+    while (ip < limit) {
+        seq = read32(src + ip);
+        h = lzHash(seq);
+        ref = table[h];
+        table[h] = ip + 1;
+
+        if (!ref || ip - (ref - 1) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        /* found a match, so see how far it goes */
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen < count - LZ_LAST_LITERALS && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+
+        op = lzSequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!op) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    /* and the rest is literals */
+    op = lzSequence(op, oend, src + anchor, count - anchor, 0, 0);
+    if (!op) return 0;
+
+    return op - dst;
+}
+
+/* read an extended length */
+static int lzReadLength(const unsigned char *src, size_t count, size_t *ip, size_t *len)
+{
+    unsigned char b;
+    do {
+        if (*ip >= count) return 0;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+/* decompress count bytes into at most cap bytes, returning the decompressed
+ * size, or -1 if the input is corrupt or doesn't fit */
+long lzDecompress(const unsigned char *src, size_t count, unsigned char *dst, size_t cap)
+{
+    size_t ip, op, llen, mlen, offset;
+    unsigned char token;
+
+    ip = op = 0;
+    while (ip < count) {
+        token = src[ip++];
+
+        /* literals */
+        llen = token >> 4;
+        if (llen == 15 && !lzReadLength(src, count, &ip, &llen)) return -1;
+        if (llen > count - ip || llen > cap - op) return -1;
+        memcpy(dst + op, src + ip, llen);
+        ip += llen;
+        op += llen;
+
+        /* the last sequence has no match */
+        if (ip == count) break;
+
+        /* match */
+        if (count - ip < 2) return -1;
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        mlen = token & 15;
+        if (mlen == 15 && !lzReadLength(src, count, &ip, &mlen)) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (mlen > cap - op) return -1;
+
+        if (offset >= mlen) {
+            memcpy(dst + op, dst + op - offset, mlen);
+            op += mlen;
+        } else {
+            /* overlapping, so it has to go byte by byte */
+            for (; mlen; mlen--, op++)
+                dst[op] = dst[op - offset];
+        }
+    }
+
+    return (long) op;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* a small, fast LZ77 codec in the LZ4 block format */
+
+/* compress count bytes into at most cap bytes, returning the compressed size,
+ * or 0 if it didn't fit */
+size_t lzCompress(const unsigned char *src, size_t count, unsigned char *dst, size_t cap);
+
+/* decompress count bytes into at most cap bytes, returning the decompressed
+ * size, or -1 if the input is corrupt or doesn't fit */
+long lzDecompress(const unsigned char *src, size_t count, unsigned char *dst, size_t cap);
+
+#endif
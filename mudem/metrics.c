@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for open_memstream */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "connpool.h"
+#include "metrics.h"
+#include "muxpoll.h"
+#include "muxsched.h"
+#include "muxsocket.h"
+#include "muxstdio.h"
+#include "slab.h"
+
+/* types */
+typedef struct _SocketMetricsL SocketMetricsL;
+
+struct _SocketMetricsL {
+    Socket ssuper;
+    int fd;
+};
+
+/* vtbl for MetricsL */
+static void metricslDestruct(Socket *self);
+static void metricslShouldSelect(Socket *self, int *r, int *w);
+static int metricslSelectedR(Socket *self, int fd);
+
+static SocketVTbl metricslVTbl = {
+    metricslDestruct, NULL, metricslShouldSelect, metricslSelectedR, NULL,
+    NULL, NULL, NULL
+};
+
+/* vtbl for Metrics (a connection being sent statistics) */
+static int metricsSelectedW(Socket *self, int fd);
+
+static SocketVTbl metricsVTbl = {
+    socketWritableDestruct, NULL, socketWritableShouldSelect, NULL,
+    metricsSelectedW, socketWritableWrite, NULL, NULL
+};
+
+/* the upper bounds of histogram buckets, in microseconds */
+static const long long histogramBounds[HISTOGRAM_BOUNDS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000, 5000000
+};
+
+/* add a duration (in microseconds) to a histogram */
+void histogramObserve(Histogram *h, long long usec)
+{
+    int i;
+
+    if (usec < 0) usec = 0;
+    for (i = 0; i < HISTOGRAM_BOUNDS && usec > histogramBounds[i]; i++);
+    h->buckets[i]++;
+    h->count++;
+    h->sum += usec;
+}
+
+/* write out a histogram (whose buckets Prometheus wants cumulative) */
+void histogramWrite(FILE *to, const char *name, const char *labels, Histogram *h)
+{
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BOUNDS; i++) {
+        total += h->buckets[i];
+        fprintf(to, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                histogramBounds[i] / 1000000.0, total);
+    }
+    fprintf(to, "%s_bucket{%s,le=\"+Inf\"} %llu\n"
+                "%s_sum{%s} %.6f\n"
+                "%s_count{%s} %llu\n",
+            name, labels, h->count, name, labels, h->sum / 1000000.0,
+            name, labels, h->count);
+}
+
+/* write out every statistic */
+void metricsWrite(FILE *to)
+{
+    muxStats(to);
+    pollStats(to);
+    schedStats(to);
+    connPoolStats(to);
+    slabStats(to);
+    socketStats(to);
+}
+
+/* destructor for MetricsL */
+static void metricslDestruct(Socket *self)
+{
+    close(((SocketMetricsL *) self)->fd);
+}
+
+/* select() for MetricsL */
+static void metricslShouldSelect(Socket *self, int *r, int *w)
+{
+    *r = ((SocketMetricsL *) self)->fd;
+    *w = -1;
+}
+
+/* accept a connection and give it the current statistics */
+static int metricslSelectedR(Socket *self, int fd)
+{
+    SocketWritable *sock;
+    FILE *out;
+    char *buf;
+    size_t bufsz;
+    int newfd;
+
+    newfd = accept(fd, NULL, NULL);
+    if (newfd < 0) return 0;
+
+    sock = (SocketWritable *) newSocket(sizeof(SocketWritable));
+    newSocketWritable(sock, newfd);
+    sock->ssuper.vtbl = &metricsVTbl;
+    socketInherit((Socket *) sock, self);
+
+    SF(out, open_memstream, NULL, (&buf, &bufsz));
+    metricsWrite(out);
+    fclose(out);
+    socketWritableWrite((Socket *) sock, buf, bufsz);
+    free(buf);
+
+    registerSocket((Socket *) sock, NULL);
+
+    return 0;
+}
+
+/* selectedW() for Metrics, which is done once it's written everything */
+static int metricsSelectedW(Socket *self, int fd)
+{
+    if (socketWritableSelectedW(self, fd)) return 1;
+    return ((SocketWritable *) self)->wbuf.used == 0;
+}
+
+/* serve statistics to every connection to a UNIX socket at path */
+void initMetrics(const char *path)
+{
+    SocketMetricsL *sock;
+    struct sockaddr_un sun;
+    int fd, tmpi;
+
+    /* make the socket */
+    SF(fd, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+    unlink(path);
+    SF(tmpi, bind, -1, (fd, (struct sockaddr *) &sun, sizeof(sun)));
+    SF(tmpi, listen, -1, (fd, 32));
+
+    /* it's ours alone, so the other side never hears of it */
+    sock = (SocketMetricsL *) newSocket(sizeof(SocketMetricsL));
+    sock->ssuper.vtbl = &metricslVTbl;
+    sock->ssuper.name = path;
+    sock->ssuper.local = 1;
+    sock->fd = fd;
+
+    registerSocket((Socket *) sock, NULL);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+/* the upper bounds of a histogram's buckets, in microseconds (there's one
+ * more for everything larger) */
+#define HISTOGRAM_BOUNDS 16
+
+/* a histogram of durations, in microseconds */
+typedef struct _Histogram Histogram;
+struct _Histogram {
+    unsigned long long buckets[HISTOGRAM_BOUNDS + 1];
+    unsigned long long count, sum;
+};
+
+/* add a duration (in microseconds) to a histogram */
+void histogramObserve(Histogram *h, long long usec);
+
+/* write out a histogram's buckets, sum and count, in seconds, for the given
+ * labels (the HELP and TYPE lines are the caller's) */
+void histogramWrite(FILE *to, const char *name, const char *labels, Histogram *h);
+
+/* write out every statistic (in Prometheus' text format) */
+void metricsWrite(FILE *to);
+
+/* serve statistics to every connection to a UNIX socket at path */
+void initMetrics(const char *path);
+
+#endif
@@ -16,157 +16,205 @@
 
 #define _BSD_SOURCE /* for strdup */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <unistd.h>
 
+#include "metrics.h"
+#include "muxpoll.h"
+#include "muxsched.h"
 #include "muxsocket.h"
+#include "muxstdio.h"
+#include "resolve.h"
 
 #include "genfd.h"
 #include "tcp4.h"
 #include "unix.h"
 
-void mapSet(struct Buffer_int *buf, int from, int to)
+static void usage()
 {
-    while (buf->bufsz <= from) EXPAND_BUFFER(*buf);
-    for (; buf->bufused <= from; buf->bufused++)
-        buf->buf[buf->bufused] = -1;
-    buf->buf[from] = to;
+    fprintf(stderr, "Use: umlbox-mudem [options] {0|1} [sockets...]\n"
+                    "Options:\n"
+                    "\t--read-max=<bytes>: Largest single read from a socket.\n"
+                    "\t--read-budget=<bytes>: Most read from one socket per wakeup.\n"
+                    "\t--coalesce-bytes=<bytes>: Hold back sends smaller than this.\n"
+                    "\t--coalesce-delay=<usec>: Longest to hold back a send (default 1000).\n"
+                    "\t--frame-max=<bytes>: Largest frame to send (default 16384).\n"
+                    "\t--compress: Compress data, if the other side also wants to.\n"
+                    "\t--metrics=<path>: Serve statistics on a UNIX socket at path.\n"
+                    "\t--resolve-ttl=<seconds>: How long to cache host names (default 60).\n"
+                    "\t--accept-max=<count>: Most connections accepted at once (default 64).\n"
+                    "\t--buffer-max=<bytes>: Most data buffered for one connection.\n"
+                    "\t--buffer-total-max=<bytes>: Most data buffered for all of them.\n"
+                    "\t--reclaim-delay=<seconds>: How long buffers stay empty before\n"
+                    "\t                           spare memory is freed (default 10,\n"
+                    "\t                           or 0 for never).\n"
+                    "\t--ping-interval=<msec>: Ping the other side this often, to time\n"
+                    "\t                         round trips over each channel.\n"
+                    "\t--transport=<transport>: Run the mux channel over this rather\n"
+                    "\t                         than stdin/stdout (see below).\n"
+                    "\t--channel=<transport>: Also use another channel.\n"
+                    "Transports:\n"
+                    "\t[fd:]<fd>[,<fd>]: Read from the first FD, write to the second.\n"
+                    "\tunix:<path>: Connect to a UNIX socket.\n"
+                    "\tunix-listen:<path>: Accept one connection on a UNIX socket.\n"
+                    "\tshm:<path>[,<bytes>]: A ring each way in a file shared with the\n"
+                    "\t                      other side (default 1048576 bytes).\n");
 }
 
-int main(int argc, char **argv)
+/* set when we've been asked for statistics */
+static volatile sig_atomic_t statsWanted = 0;
+
+static void statsSignal(int sig)
 {
-    int preferredId, i, tmpi;
-    struct Buffer_int readMap, writeMap; /* maps of fd -> id */
-    fd_set readfds, writefds;
-    int nfds, nsocks, r, w;
-    Socket *sock;
-    char ocbuf;
-
-    if (argc < 2 || !argv[1][0] || argv[1][1]) {
-        fprintf(stderr, "Use: umlbox-mudem {0|1} [sockets...]\n");
-        return 1;
+    statsWanted = 1;
+}
+
+/* the transports asked for, which are only set up once we know our side */
+static const char *transportSpec = NULL;
+static const char *channelSpecs[MUX_CHANNELS_MAX];
+static int channelSpecCount = 0;
+
+/* handle a --channel=<transport> option */
+static void channelOption(const char *arg)
+{
+    if (channelSpecCount == MUX_CHANNELS_MAX) {
+        fprintf(stderr, "Too many channels.\n");
+        exit(1);
     }
+    channelSpecs[channelSpecCount++] = arg;
+}
 
-    preferredId = atoi(argv[1]);
+/* handle a --name=<size> option of at least min, returning 1 if arg was that
+ * option */
+static int sizeOptionMin(const char *arg, const char *name, size_t *into, unsigned long min)
+{
+    size_t len = strlen(name);
+    char *end;
+    unsigned long val;
 
-    /* initialize everything */
-    initSockets(preferredId);
-    initGenFD();
-    initTCP4();
-    initUNIX();
+    if (strncmp(arg, name, len) || arg[len] != '=') return 0;
 
-    /* perform our handshake (A->B->C) */
-    if (preferredId == 1) {
-        struct timeval timeout;
-
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        FD_SET(0, &readfds);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 4000; /* arbitrary */
-
-        /* start by spamming 'A's */
-        while (1) {
-            write(1, "A", 1);
-            SF(tmpi, select, -1, (1, &readfds, NULL, NULL, &timeout));
-            if (tmpi) {
-                ocbuf = '\0';
-                read(0, &ocbuf, 1);
-                if (ocbuf == 'B') break;
-            }
-        }
+    val = strtoul(arg + len + 1, &end, 10);
+    if (end == arg + len + 1 || *end || val < min) {
+        fprintf(stderr, "Invalid value for %s.\n", name);
+        exit(1);
+    }
+    *into = val;
 
-        /* then finalize with a 'C' */
-        write(1, "C", 1);
+    return 1;
+}
 
-    } else {
-        /* start by waiting for an 'A' */
-        while (1) {
-            ocbuf = '\0';
-            read(0, &ocbuf, 1);
-            if (ocbuf == 'A') break;
+/* handle a --name=<size> option (which mustn't be 0) */
+static int sizeOption(const char *arg, const char *name, size_t *into)
+{
+    return sizeOptionMin(arg, name, into, 1);
+}
+
+int main(int argc, char **argv)
+{
+    int preferredId, argi, i, tmpi;
+    const char *metricsPath = NULL;
+
+    /* get our options */
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *arg = argv[argi];
+        if (sizeOption(arg, "--read-max", &socketReadMax)) {
+        } else if (sizeOption(arg, "--read-budget", &socketReadBudget)) {
+        } else if (sizeOption(arg, "--coalesce-bytes", &socketCoalesceBytes)) {
+        } else if (sizeOption(arg, "--coalesce-delay", &socketCoalesceDelay)) {
+        } else if (sizeOption(arg, "--frame-max", &schedFrameMax)) {
+        } else if (sizeOption(arg, "--resolve-ttl", &resolveTTL)) {
+        } else if (sizeOption(arg, "--accept-max", &socketAcceptMax)) {
+        } else if (sizeOption(arg, "--buffer-max", &socketBufferMax)) {
+        } else if (sizeOption(arg, "--buffer-total-max", &socketBufferTotalMax)) {
+        } else if (sizeOptionMin(arg, "--reclaim-delay", &socketReclaimDelay, 0)) {
+        } else if (sizeOption(arg, "--ping-interval", &muxPingInterval)) {
+        } else if (!strcmp(arg, "--compress")) {
+            muxFeatures |= MUX_FEATURE_COMPRESS;
+        } else if (!strncmp(arg, "--channel=", 10) && arg[10]) {
+            channelOption(arg + 10);
+        } else if (!strncmp(arg, "--transport=", 12) && arg[12]) {
+            transportSpec = arg + 12;
+        } else if (!strncmp(arg, "--metrics=", 10) && arg[10]) {
+            metricsPath = arg + 10;
+        } else {
+            usage();
+            return 1;
         }
+    }
 
-        /* then tell them we're here */
-        write(1, "B", 1);
+    if (argi >= argc || !argv[argi][0] || argv[argi][1]) {
+        usage();
+        return 1;
+    }
+
+    preferredId = atoi(argv[argi++]);
 
-        /* and wait for the 'C' that ends the handshake */
-        while (1) {
-            ocbuf = '\0';
-            read(0, &ocbuf, 1);
-            if (ocbuf == 'C') break;
+    /* the other side mustn't send more than a connection may buffer */
+    if (socketBufferMax && socketBufferMax < muxWindow)
+        muxWindow = socketBufferMax;
+
+    /* set up our transports (which may wait for the other side) */
+    if (transportSpec)
+        muxUseTransport(newMuxTransport(transportSpec, preferredId));
+    for (i = 0; i < channelSpecCount; i++) {
+        if (muxAddChannel(newMuxTransport(channelSpecs[i], preferredId)) < 0) {
+            fprintf(stderr, "Too many channels.\n");
+            exit(1);
         }
+    }
 
+    /* initialize everything */
+    initSockets(preferredId);
+    initGenFD();
+    initTCP4();
+    initUNIX();
+
+    /* perform our handshake */
+    muxHandshake(preferredId);
+    initMuxChannels();
+
+    /* SIGUSR1 dumps statistics (without restarting, so we see it promptly) */
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = statsSignal;
+        sigemptyset(&sa.sa_mask);
+        SF(tmpi, sigaction, -1, (SIGUSR1, &sa, NULL));
+
+        /* and a socket closing under us is noticed when writing fails */
+        sa.sa_handler = SIG_IGN;
+        SF(tmpi, sigaction, -1, (SIGPIPE, &sa, NULL));
     }
 
-    /* now create every socket */
-    for (i = 2; i < argc; i++) {
+    /* now create every socket (with IDs from 2, to match the other side) */
+    for (i = 2; argi < argc; i++, argi++) {
         Socket *sock;
         char *arg;
 
-        SF(arg, strdup, NULL, (argv[i]));
+        SF(arg, strdup, NULL, (argv[argi]));
         sock = socketByName(arg);
 
         if (sock == NULL) {
-            fprintf(stderr, "Invalid socket %s.\n", argv[i]);
+            fprintf(stderr, "Invalid socket %s.\n", argv[argi]);
             exit(1);
         }
 
         registerSocket(sock, &i);
     }
 
-    INIT_BUFFER(readMap);
-    INIT_BUFFER(writeMap);
+    /* then our own (which the other side never knows about) */
+    if (metricsPath)
+        initMetrics(metricsPath);
 
-    /* and go into our select loop */
+    /* and go into our event loop */
     while (1) {
-        readMap.bufused = 0;
-        writeMap.bufused = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        nfds = 0;
-        nsocks = socketCount();
-
-        /* detect every socket */
-        for (i = 0; i < nsocks; i++) {
-            sock = socketById(i);
-            if (sock && sock->vtbl->shouldSelect) {
-                sock->vtbl->shouldSelect(sock, &r, &w);
-                if (r >= 0) {
-                    mapSet(&readMap, r, i);
-                    if (r >= nfds) nfds = r + 1;
-                    FD_SET(r, &readfds);
-                }
-                if (w >= 0) {
-                    mapSet(&writeMap, w, i);
-                    if (w >= nfds) nfds = w + 1;
-                    FD_SET(w, &writefds);
-                }
-            }
-        }
-
-        /* then select them */
-        SF(tmpi, select, -1, (nfds, &readfds, &writefds, NULL, NULL));
-
-        /* now perform actions */
-        for (i = 0; i < nfds; i++) {
-            if (FD_ISSET(i, &readfds)) {
-                sock = socketById(readMap.buf[i]);
-                if (sock && sock->vtbl->selectedR(sock, i) != 0) {
-                    freeSocket(sock);
-                }
-            }
-            if (FD_ISSET(i, &writefds)) {
-                sock = socketById(writeMap.buf[i]);
-                if (sock && sock->vtbl->selectedW(sock, i) != 0) {
-                    freeSocket(sock);
-                }
-            }
+        pollRun(-1);
+        if (statsWanted) {
+            statsWanted = 0;
+            metricsWrite(stderr);
         }
     }
 
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "muxpoll.h"
+#include "timer.h"
+
+BUFFER(epoll_event, struct epoll_event);
+
+/* our epoll FD */
+static int epfd;
+
+/* map of fd -> socket ID */
+static struct Buffer_int fdMap;
+
+/* FDs epoll refuses (regular files), which are always ready */
+static struct Buffer_int readyFds;
+
+/* space for returned events */
+static struct Buffer_epoll_event events;
+
+/* statistics: wakeups, events handled, and time spent handling them (in
+ * total and at most in one wakeup, in microseconds), and changes to what's
+ * polled */
+static unsigned long long pollWakeups, pollEvents, pollBusy, pollBusyMax,
+                          pollChanges;
+
+/* initialize the poller */
+void initPoll()
+{
+    SF(epfd, epoll_create, -1, (64));
+    INIT_BUFFER(fdMap);
+    INIT_BUFFER(readyFds);
+    INIT_BUFFER(events);
+}
+
+/* set the socket an FD belongs to */
+static void fdMapSet(int fd, int id)
+{
+    while (fdMap.bufsz <= fd) EXPAND_BUFFER(fdMap);
+    for (; fdMap.bufused <= fd; fdMap.bufused++)
+        fdMap.buf[fdMap.bufused] = -1;
+    fdMap.buf[fd] = id;
+}
+
+/* add or remove an FD from the always-ready list */
+static void readyFdSet(int fd, int ready)
+{
+    size_t i;
+    for (i = 0; i < readyFds.bufused; i++) {
+        if (readyFds.buf[i] == fd) {
+            if (!ready)
+                readyFds.buf[i] = readyFds.buf[--readyFds.bufused];
+            return;
+        }
+    }
+    if (ready)
+        WRITE_ONE_BUFFER(readyFds, fd);
+}
+
+/* change the registration of one FD, given what it was and what it is */
+static void pollFd(Socket *sock, int fd, int oldR, int oldW)
+{
+    struct epoll_event ev;
+    uint32_t oldEv, newEv;
+    int op, tmpi;
+
+    if (fd < 0) return;
+
+    oldEv = (oldR == fd ? EPOLLIN : 0) | (oldW == fd ? EPOLLOUT : 0);
+    newEv = (sock->pollR == fd ? EPOLLIN : 0) | (sock->pollW == fd ? EPOLLOUT : 0);
+    if (oldEv == newEv) return;
+    pollChanges++;
+
+    if (!oldEv) {
+        op = EPOLL_CTL_ADD;
+        fdMapSet(fd, sock->id);
+    } else if (!newEv) {
+        op = EPOLL_CTL_DEL;
+        fdMapSet(fd, -1);
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = newEv;
+    ev.data.fd = fd;
+    tmpi = epoll_ctl(epfd, op, fd, &ev);
+    if (tmpi < 0) {
+        if (errno == EPERM || (op != EPOLL_CTL_ADD && errno == ENOENT)) {
+            /* not pollable, so just pretend it's always ready */
+            readyFdSet(fd, newEv != 0);
+        } else {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+}
+
+/* re-ask a socket what it wants to select, and update the poller if that
+ * changed */
+void pollUpdate(Socket *sock)
+{
+    int r, w, oldR, oldW;
+
+    if (sock->id < 0) return;
+
+    r = w = -1;
+    if (sock->vtbl->shouldSelect)
+        sock->vtbl->shouldSelect(sock, &r, &w);
+    if (r == sock->pollR && w == sock->pollW) return;
+
+    oldR = sock->pollR;
+    oldW = sock->pollW;
+    sock->pollR = r;
+    sock->pollW = w;
+
+    /* every FD that was or is involved needs updating exactly once */
+    pollFd(sock, oldR, oldR, oldW);
+    if (oldW != oldR)
+        pollFd(sock, oldW, oldR, oldW);
+    if (r != oldR && r != oldW)
+        pollFd(sock, r, oldR, oldW);
+    if (w != oldR && w != oldW && w != r)
+        pollFd(sock, w, oldR, oldW);
+}
+
+/* stop polling anything for this socket (before its FDs are closed) */
+void pollForget(Socket *sock)
+{
+    int oldR, oldW;
+
+    oldR = sock->pollR;
+    oldW = sock->pollW;
+    sock->pollR = sock->pollW = -1;
+
+    pollFd(sock, oldR, oldR, oldW);
+    if (oldW != oldR)
+        pollFd(sock, oldW, oldR, oldW);
+}
+
+/* dispatch an event on an FD to its socket */
+static void pollDispatch(int fd, uint32_t ev)
+{
+    Socket *sock;
+    int id;
+
+    if (fd >= fdMap.bufused) return;
+    id = fdMap.buf[fd];
+    sock = socketById(id);
+    if (sock == NULL) return;
+
+    if ((ev & (EPOLLIN|EPOLLHUP|EPOLLERR)) && sock->pollR == fd) {
+        if (sock->vtbl->selectedR(sock, fd) != 0) {
+            freeSocket(sock);
+            return;
+        }
+
+        /* selectedR may have done anything, including freeing us */
+        if (socketById(id) != sock) return;
+    }
+
+    if ((ev & (EPOLLOUT|EPOLLHUP|EPOLLERR)) && sock->pollW == fd) {
+        if (sock->vtbl->selectedW(sock, fd) != 0)
+            freeSocket(sock);
+    }
+}
+
+/* wait for events (timeout in ms, -1 for forever, and never past the next
+ * timer) and dispatch them, then fire any due timers */
+void pollRun(int timeout)
+{
+    int nev, i, ttimeout;
+    long long start, busy;
+
+    /* don't sleep past the next timer */
+    ttimeout = timerTimeout();
+    if (ttimeout >= 0 && (timeout < 0 || ttimeout < timeout)) timeout = ttimeout;
+    if (readyFds.bufused) timeout = 0;
+
+    nev = epoll_wait(epfd, events.buf, events.bufsz, timeout);
+    if (nev < 0) {
+        if (errno == EINTR) return;
+        perror("epoll_wait");
+        exit(1);
+    }
+    start = timerNow();
+
+    for (i = 0; i < nev; i++)
+        pollDispatch(events.buf[i].data.fd, events.buf[i].events);
+
+    /* the always-ready FDs (going backwards, as they may remove themselves) */
+    for (i = (int) readyFds.bufused - 1; i >= 0; i--) {
+        if (i < readyFds.bufused)
+            pollDispatch(readyFds.buf[i], EPOLLIN|EPOLLOUT);
+    }
+
+    /* then anything that's due */
+    timerRun();
+
+    busy = timerNow() - start;
+    pollWakeups++;
+    pollEvents += nev;
+    pollBusy += busy;
+    if (busy > pollBusyMax) pollBusyMax = busy;
+
+    /* if we filled our event buffer, there may be more waiting next time */
+    if (nev == events.bufsz)
+        EXPAND_BUFFER(events);
+}
+
+/* shrink the poller's buffers back down, if they grew */
+void pollReclaim()
+{
+    /* (events is only ever filled by epoll_wait, so it's never in use
+     * between wakeups) */
+    while (events.bufsz > BUFFER_DEFAULT_SIZE)
+        SHRINK_BUFFER(events);
+}
+
+/* write out statistics (in Prometheus' text format) */
+void pollStats(FILE *to)
+{
+    fprintf(to, "# HELP mudem_loop_wakeups_total Event loop wakeups.\n"
+                "# TYPE mudem_loop_wakeups_total counter\n"
+                "mudem_loop_wakeups_total %llu\n"
+                "# HELP mudem_loop_events_total Events handled.\n"
+                "# TYPE mudem_loop_events_total counter\n"
+                "mudem_loop_events_total %llu\n"
+                "# HELP mudem_loop_busy_seconds_total Time spent handling events.\n"
+                "# TYPE mudem_loop_busy_seconds_total counter\n"
+                "mudem_loop_busy_seconds_total %.6f\n"
+                "# HELP mudem_loop_busy_max_seconds Longest time spent in one wakeup.\n"
+                "# TYPE mudem_loop_busy_max_seconds gauge\n"
+                "mudem_loop_busy_max_seconds %.6f\n"
+                "# HELP mudem_loop_changes_total Changes to what an FD is polled for.\n"
+                "# TYPE mudem_loop_changes_total counter\n"
+                "mudem_loop_changes_total %llu\n",
+            pollWakeups, pollEvents, pollBusy / 1000000.0,
+            pollBusyMax / 1000000.0, pollChanges);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MUXPOLL_H
+#define MUXPOLL_H
+
+#include <stdio.h>
+
+#include "muxsocket.h"
+
+/* initialize the poller */
+void initPoll();
+
+/* re-ask a socket what it wants to select, and update the poller if that
+ * changed */
+void pollUpdate(Socket *sock);
+
+/* stop polling anything for this socket (before its FDs are closed) */
+void pollForget(Socket *sock);
+
+/* wait for events (timeout in ms, -1 for forever, and never past the next
+ * timer) and dispatch them, then fire any due timers */
+void pollRun(int timeout);
+
+/* shrink the poller's buffers back down, if they grew */
+void pollReclaim();
+
+/* write out statistics */
+void pollStats(FILE *to);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lz.h"
+#include "muxsched.h"
+#include "muxstdio.h"
+
+/* the largest 's' frame we send (and each stream's round-robin quantum) */
+size_t schedFrameMax = 16384;
+
+/* compression must save at least 1/this of a frame to be worth it */
+#define SCHED_COMPRESS_GAIN 8
+
+/* the most frames a stream skips compressing after it didn't pay off */
+#define SCHED_COMPRESS_BACKOFF_MAX 64
+
+/* buffers for compression */
+static unsigned char *zIn, *zOut;
+
+/* compression statistics: frames and bytes we tried to compress, and what
+ * was actually sent for them */
+static unsigned long long zFrames, zFramesSent, zRawBytes, zSentBytes;
+
+/* we only fill the mux channel's buffer up to this many frames' worth, so a
+ * newly active stream never waits behind much */
+#define SCHED_LOW_FRAMES 2
+
+/* the streams with something to send on each channel in each priority
+ * class, as a circular list starting at whichever stream's turn it is */
+static Socket *schedTurn[MUX_CHANNELS_MAX][SCHED_PRIO_MAX + 1];
+
+static void schedHoldFire(Timer *timer);
+
+/* initialize a socket's scheduling state */
+void schedInit(Socket *sock)
+{
+    initChunkBuffer(&sock->out);
+    initTimer(&sock->holdTimer, schedHoldFire);
+    sock->schedPrev = sock->schedNext = NULL;
+    sock->deficit = 0;
+    sock->zSkip = sock->zBackoff = 0;
+}
+
+/* put a stream in line to send, at the back of its class */
+static void schedActivate(Socket *sock)
+{
+    Socket **turn = &schedTurn[MUX_CHANNEL(sock->id)][sock->opts.prio];
+
+    timerCancel(&sock->holdTimer);
+    if (sock->schedNext) return;
+
+    if (*turn) {
+        sock->schedNext = *turn;
+        sock->schedPrev = (*turn)->schedPrev;
+        sock->schedPrev->schedNext = sock;
+        (*turn)->schedPrev = sock;
+    } else {
+        sock->schedNext = sock->schedPrev = sock;
+        *turn = sock;
+    }
+    sock->deficit = 0;
+}
+
+/* take a stream out of line */
+static void schedDeactivate(Socket *sock)
+{
+    Socket **turn = &schedTurn[MUX_CHANNEL(sock->id)][sock->opts.prio];
+
+    timerCancel(&sock->holdTimer);
+    if (!sock->schedNext) return;
+
+    if (sock->schedNext == sock) {
+        *turn = NULL;
+    } else {
+        sock->schedPrev->schedNext = sock->schedNext;
+        sock->schedNext->schedPrev = sock->schedPrev;
+        if (*turn == sock) *turn = sock->schedNext;
+    }
+    sock->schedNext = sock->schedPrev = NULL;
+    sock->deficit = 0;
+}
+
+/* try to send one frame of a stream's queued data compressed, returning 1 if
+ * it was sent (compressed or not) */
+static int schedFrameCompressed(Socket *sock, Socket *out, size_t count)
+{
+    size_t zlen;
+
+    /* (only ever offered through the capabilities, which older versions
+     * don't send) */
+    if (muxVersion < 2 || !(muxFeatures & muxPeerFeatures & MUX_FEATURE_COMPRESS) ||
+        sock->opts.nocompress || count > MUX_COMPRESS_MAX)
+        return 0;
+
+    /* this stream may not be worth the effort */
+    if (sock->zSkip) {
+        sock->zSkip--;
+        return 0;
+    }
+
+    if (!zIn) {
+        SF(zIn, malloc, NULL, (MUX_COMPRESS_MAX));
+        SF(zOut, malloc, NULL, (MUX_COMPRESS_MAX + 4));
+    }
+
+    chunkBufferRead(&sock->out, zIn, count);
+    zlen = lzCompress(zIn, count, zOut + 4, count - count / SCHED_COMPRESS_GAIN);
+    zFrames++;
+    zRawBytes += count;
+
+    if (zlen) {
+        muxPrepareInt(zOut, (int32_t) count);
+        muxCommandInt(out, 'z', sock->id, (int32_t) (zlen + 4));
+        out->vtbl->write(out, zOut, zlen + 4);
+        zFramesSent++;
+        zSentBytes += zlen + 4;
+        sock->zBackoff = 0;
+
+    } else {
+        /* didn't pay off, so send it as is and back off */
+        muxCommandInt(out, 's', sock->id, (int32_t) count);
+        out->vtbl->write(out, zIn, count);
+        zSentBytes += count;
+        sock->zBackoff = sock->zBackoff ? sock->zBackoff * 2 : 1;
+        if (sock->zBackoff > SCHED_COMPRESS_BACKOFF_MAX)
+            sock->zBackoff = SCHED_COMPRESS_BACKOFF_MAX;
+        sock->zSkip = sock->zBackoff;
+
+    }
+
+    return 1;
+}
+
+/* send one frame of a stream's queued data */
+static void schedFrame(Socket *sock, size_t count)
+{
+    Socket *out = MUX_OUT(sock->id);
+
+    sock->framesSent++;
+    if (!schedFrameCompressed(sock, out, count)) {
+        muxCommandInt(out, 's', sock->id, (int32_t) count);
+        socketWritableMove(out, &sock->out, count);
+    }
+    socketAccount(sock);
+}
+
+/* a held back stream has waited long enough */
+static void schedHoldFire(Timer *timer)
+{
+    Socket *sock = (Socket *) ((char *) timer - offsetof(Socket, holdTimer));
+    schedActivate(sock);
+    schedRun(MUX_CHANNEL(sock->id));
+}
+
+/* queue data read from a socket to be sent to the other side */
+void schedSend(Socket *sock, const void *buf, size_t count)
+{
+    chunkBufferWrite(&sock->out, buf, count);
+    socketAccount(sock);
+
+    if (sock->schedNext) {
+        /* already in line */
+
+    } else if (socketCoalesceBytes && !sock->opts.nodelay &&
+               sock->out.used < socketCoalesceBytes) {
+        /* hold it back for a bit in case more comes */
+        if (!sock->holdTimer.when)
+            timerSet(&sock->holdTimer, timerNow() + socketCoalesceDelay);
+        return;
+
+    } else {
+        schedActivate(sock);
+
+    }
+
+    schedRun(MUX_CHANNEL(sock->id));
+}
+
+/* send everything a socket has queued right now, bypassing the schedule
+ * (before a 'd') */
+void schedFlush(Socket *sock)
+{
+    size_t count;
+
+    schedDeactivate(sock);
+    while (sock->out.used) {
+        count = sock->out.used;
+        if (count > schedFrameMax) count = schedFrameMax;
+        schedFrame(sock, count);
+    }
+}
+
+/* discard everything a socket has queued */
+void schedDrop(Socket *sock)
+{
+    schedDeactivate(sock);
+    freeChunkBuffer(&sock->out);
+    socketAccount(sock);
+}
+
+/* fill a mux channel's buffer from its queued streams: strict priority
+ * between classes, deficit round-robin within them */
+void schedRun(int channel)
+{
+    SocketWritable *out = (SocketWritable *) muxOut[channel];
+    Socket **turn = schedTurn[channel];
+    Socket *sock;
+    size_t count;
+    int prio;
+
+    while (out->wbuf.used < SCHED_LOW_FRAMES * schedFrameMax) {
+        for (prio = SCHED_PRIO_MAX; prio >= 0 && !turn[prio]; prio--);
+        if (prio < 0) return;
+        sock = turn[prio];
+
+        /* a new turn gets a new quantum */
+        if (sock->deficit == 0)
+            sock->deficit = schedFrameMax;
+
+        count = sock->out.used;
+        if (count > sock->deficit) count = sock->deficit;
+        schedFrame(sock, count);
+        sock->deficit -= count;
+
+        if (sock->out.used == 0) {
+            schedDeactivate(sock);
+        } else if (sock->deficit == 0) {
+            turn[prio] = sock->schedNext;
+        }
+    }
+}
+
+/* write out statistics (in Prometheus' text format) */
+void schedStats(FILE *to)
+{
+    fprintf(to, "# HELP mudem_compress_frames_total Frames we tried to compress.\n"
+                "# TYPE mudem_compress_frames_total counter\n"
+                "mudem_compress_frames_total %llu\n"
+                "# HELP mudem_compress_frames_compressed_total Frames sent compressed.\n"
+                "# TYPE mudem_compress_frames_compressed_total counter\n"
+                "mudem_compress_frames_compressed_total %llu\n"
+                "# HELP mudem_compress_raw_bytes_total Bytes we tried to compress.\n"
+                "# TYPE mudem_compress_raw_bytes_total counter\n"
+                "mudem_compress_raw_bytes_total %llu\n"
+                "# HELP mudem_compress_sent_bytes_total Bytes sent for them.\n"
+                "# TYPE mudem_compress_sent_bytes_total counter\n"
+                "mudem_compress_sent_bytes_total %llu\n",
+            zFrames, zFramesSent, zRawBytes, zSentBytes);
+}
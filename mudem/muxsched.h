@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MUXSCHED_H
+#define MUXSCHED_H
+
+#include <stdio.h>
+
+#include "muxsocket.h"
+
+/* priority classes run from 0 (the default) to this, highest first */
+#define SCHED_PRIO_MAX 3
+
+/* the largest 's' frame we send (and each stream's round-robin quantum) */
+extern size_t schedFrameMax;
+
+/* write out statistics */
+void schedStats(FILE *to);
+
+/* initialize a socket's scheduling state */
+void schedInit(Socket *sock);
+
+/* queue data read from a socket to be sent to the other side */
+void schedSend(Socket *sock, const void *buf, size_t count);
+
+/* send everything a socket has queued right now, bypassing the schedule
+ * (before a 'd') */
+void schedFlush(Socket *sock);
+
+/* discard everything a socket has queued */
+void schedDrop(Socket *sock);
+
+/* fill a mux channel's buffer from its queued streams */
+void schedRun(int channel);
+
+#endif
@@ -14,24 +14,59 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define _POSIX_SOURCE /* for strtok_r */
+#define _GNU_SOURCE /* for strtok_r, strdup, accept4 */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __GLIBC__
+#include <malloc.h> /* for malloc_trim */
+#endif
+
+#include "connpool.h"
+#include "muxpoll.h"
+#include "muxsched.h"
 #include "muxsocket.h"
 #include "muxstdio.h"
+#include "slab.h"
 
 /* NULL vtbl */
 static SocketVTbl nullVTbl = {
-    NULL, NULL, NULL, NULL, NULL, NULL
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/* a slot in the socket table */
+typedef struct _SocketSlot SocketSlot;
+struct _SocketSlot {
+    Socket *sock;
+
+    /* the generation the next socket in this slot gets */
+    int gen;
+
+    /* free slots of our own parity are listed, to allocate them in O(1) */
+    int freePrev, freeNext;
+
+    /* set while an older version is yet to echo our 'd' for the slot's last
+     * socket, until which it isn't free (it has no generations to tell a
+     * late echo from a 'd' for the next socket) */
+    int echoWait;
 };
 
-/* array of all current sockets */
-static struct Buffer_Socket sockets;
+BUFFER(SocketSlot, SocketSlot);
+
+/* table of all current sockets, and the first free slot of our parity (-1
+ * if none) */
+static struct Buffer_SocketSlot sockets;
+static int socketFree = -1;
+
+/* generation for slots that are new to the table (the newest of any slot
+ * dropped off its end, since the other side may have seen it) */
+static int socketGenSeed = 0;
 
 /* and nameables */
 static NameableSocket *nameableSockets;
@@ -42,17 +77,80 @@ Socket *stdinSocket, *stdoutSocket;
 /* preferred ID offset */
 static int socketPreferredId;
 
+/* connections made and sockets disconnected */
+static unsigned long long socketConnects, socketDisconnects;
+
+/* the smallest (and initial) read size for socketSelectedR */
+#define SOCKET_READ_MIN 1024
+
+/* read sizing and fairness */
+size_t socketReadMax = 65536;
+size_t socketReadBudget = 262144;
+
+/* the most connections accepted at once */
+size_t socketAcceptMax = 64;
+
+/* buffer for socketSelectedR, socketReadMax bytes */
+static char *readBuf;
+
+/* coalescing of small sends */
+size_t socketCoalesceBytes = 0;
+size_t socketCoalesceDelay = 1000;
+
+/* buffer limits and reclaiming */
+size_t socketBufferMax = 0, socketBufferTotalMax = 0;
+size_t socketBuffered = 0;
+size_t socketReclaimDelay = SOCKET_RECLAIM_DELAY_DEFAULT;
+
+/* set while over socketBufferTotalMax: nothing is read from connections and
+ * the other side isn't granted more until it's back under 3/4 of it */
+static int socketsLimited = 0;
+static Timer socketResumeTimer;
+
+/* when the total buffered last fell to nothing, and the timer to give memory
+ * back once it's stayed there */
+static long long socketDrainedAt;
+static Timer socketReclaimTimer;
+
+/* connections closed for going over their buffer limit, and reclaims */
+static unsigned long long socketOverflows, socketReclaims;
+
 /* base constructor for all sockets */
 Socket *newSocket(size_t sz)
 {
     Socket *ret;
-    SF(ret, malloc, NULL, (sz));
+    ret = (Socket *) slabAlloc(sz);
     ret->sz = sz;
     ret->vtbl = &nullVTbl;
     ret->id = -1;
+    ret->pollR = ret->pollW = -1;
+    ret->readSize = SOCKET_READ_MIN;
+    if (ret->readSize > socketReadMax) ret->readSize = socketReadMax;
+    ret->credit = muxPeerWindow;
+    ret->owed = 0;
+    memset(&ret->opts, 0, sizeof(ret->opts));
+    ret->name = NULL;
+    ret->local = 0;
+    ret->bytesRead = ret->bytesWritten = 0;
+    ret->framesSent = ret->framesReceived = 0;
+    ret->parentId = -1;
+    ret->buffered = 0;
+    schedInit(ret);
     return ret;
 }
 
+/* copy options (and the name) from the socket a connection was made from */
+void socketInherit(Socket *self, Socket *parent)
+{
+    self->opts = parent->opts;
+    self->name = parent->name;
+    self->local = parent->local;
+    self->parentId = parent->id;
+
+    /* every connection is made from some socket, so this counts them */
+    if (!self->local) socketConnects++;
+}
+
 /* super-constructor for writable sockets */
 void newSocketWritable(SocketWritable *self, int fd)
 {
@@ -63,14 +161,28 @@ void newSocketWritable(SocketWritable *self, int fd)
     SF(tmpi, fcntl, -1, (fd, F_SETFL, flags | O_NONBLOCK));
 
     self->fd = fd;
-    INIT_BUFFER(self->wbuf);
+    initChunkBuffer(&self->wbuf);
+    self->wbufHigh = 0;
+    self->connecting = 0;
+}
+
+/* connect a SocketWritable's fd without blocking */
+int socketWritableConnect(SocketWritable *self, const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (connect(self->fd, addr, addrlen) == 0) return 0;
+    if (errno != EINPROGRESS && errno != EINTR) return -1;
+
+    /* wait for it to be writable */
+    self->connecting = 1;
+    pollUpdate((Socket *) self);
+    return 0;
 }
 
 /* generic destruct() for SocketWritable */
 void socketWritableDestruct(Socket *self)
 {
     close(((SocketWritable *) self)->fd);
-    FREE_BUFFER(((SocketWritable *) self)->wbuf);
+    freeChunkBuffer(&((SocketWritable *) self)->wbuf);
 }
 
 /* generic shouldSelect() for SocketWritable */
@@ -79,57 +191,127 @@ void socketWritableShouldSelect(Socket *self, int *r, int *w)
     SocketWritable *sockw = (SocketWritable *) self;
 
     *r = -1;
-    if (sockw->wbuf.bufused > 0) {
+    if (sockw->wbuf.used > 0 || sockw->connecting) {
         *w = ((SocketWritable *) self)->fd;
     } else {
         *w = -1;
     }
 }
 
-/* generic shouldSelect() for SocketWritables which are also readable */
+/* generic shouldSelect() for SocketWritables which are also readable (while
+ * they have sending credit) */
 void socketWritableShouldSelectR(Socket *self, int *r, int *w)
 {
     socketWritableShouldSelect(self, r, w);
-    *r = ((SocketWritable *) self)->fd;
+    if (socketMayRead(self) && !((SocketWritable *) self)->connecting)
+        *r = ((SocketWritable *) self)->fd;
 }
 
 /* generic selectedR() for any socket that uses simple FDs */
 int socketSelectedR(Socket *self, int fd)
 {
-    char buf[1024];
     ssize_t rd;
+    size_t size, total;
+
+    /* read until the socket is drained, we're out of credit, or it's
+     * somebody else's turn */
+    total = 0;
+    do {
+        /* (if that's changed since we were polled, stop polling) */
+        if (!socketMayRead(self)) {
+            pollUpdate(self);
+            break;
+        }
+        size = self->readSize;
+        if (size > self->credit) size = self->credit;
 
-    /* try to read */
-    rd = read(fd, buf, 1024);
+        rd = read(fd, readBuf, size);
 
-    if (rd <= 0) {
-        /* BAD! */
-        return 1;
-    }
+        if (rd < 0 && (errno == EAGAIN || errno == EINTR)) {
+            /* drained (or a spurious wakeup) */
+            return 0;
+        }
 
-    /* say we read it */
-    socketRead(self, buf, rd);
+        if (rd <= 0) {
+            /* BAD! */
+            return 1;
+        }
+
+        /* say we read it */
+        socketRead(self, readBuf, rd);
+        total += rd;
+
+        /* adapt the read size to how much is actually arriving */
+        if (rd == size) {
+            if (size == self->readSize) {
+                self->readSize *= 2;
+                if (self->readSize > socketReadMax) self->readSize = socketReadMax;
+            }
+        } else {
+            if (rd < self->readSize / 4 && self->readSize > SOCKET_READ_MIN)
+                self->readSize /= 2;
+
+            /* a short read means there's nothing more for now */
+            break;
+        }
+    } while (total < socketReadBudget);
 
     return 0;
 }
 
+/* grant the other side what we owe it for a socket, once that's enough to be
+ * worth a 'w' (and we aren't over the total buffer limit). Older versions
+ * don't count, and would take a 'w' for an unknown command, so they never
+ * get one */
+static void socketGrant(Socket *self)
+{
+    if (muxVersion < 2) return;
+    if (self->owed >= muxWindow / 4 && !socketsLimited) {
+        muxCommandInt(MUX_OUT(self->id), 'w', self->id, (int32_t) self->owed);
+        self->owed = 0;
+    }
+}
+
 /* generic selectedW() for SocketWritable */
 int socketWritableSelectedW(Socket *self, int fd)
 {
     ssize_t wrote;
     SocketWritable *sockw = (SocketWritable *) self;
+    int err;
+    socklen_t errlen;
+
+    /* finish connecting */
+    if (sockw->connecting) {
+        errlen = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err)
+            return 1;
+        sockw->connecting = 0;
+        pollUpdate(self);
+        if (sockw->wbuf.used == 0) return 0;
+    }
 
     /* write as much of the buffer as we can */
-    wrote = write(fd, sockw->wbuf.buf, sockw->wbuf.bufused);
+    wrote = chunkBufferWriteFd(&sockw->wbuf, fd);
 
     if (wrote < 0) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+
         /* BAD! */
         return 1;
     }
 
-    /* move down the remainder */
-    memmove(sockw->wbuf.buf, sockw->wbuf.buf + wrote, sockw->wbuf.bufused - wrote);
-    sockw->wbuf.bufused -= wrote;
+    /* nothing left to write, so stop polling for it */
+    if (sockw->wbuf.used == 0)
+        pollUpdate(self);
+    self->bytesWritten += wrote;
+
+    /* everything but the mux channel itself was written on behalf of the
+     * other side, which may now send more (if it's counting) */
+    if (self != stdoutSocket && !self->local) {
+        socketAccount(self);
+        self->owed += wrote;
+        socketGrant(self);
+    }
 
     return 0;
 }
@@ -138,61 +320,394 @@ int socketWritableSelectedW(Socket *self, int fd)
 void socketWritableWrite(Socket *self, const void *buf, size_t count)
 {
     SocketWritable *sockw = (SocketWritable *) self;
-    WRITE_BUFFER(sockw->wbuf, buf, count);
+    int wasEmpty = (sockw->wbuf.used == 0);
+
+    chunkBufferWrite(&sockw->wbuf, buf, count);
+    if (sockw->wbuf.used > sockw->wbufHigh) sockw->wbufHigh = sockw->wbuf.used;
+
+    /* now we have something to write */
+    if (wasEmpty && count)
+        pollUpdate(self);
+}
+
+/* generic writeSpace() for SocketWritable */
+int socketWritableWriteSpace(Socket *self, struct iovec *iov, int iovmax, size_t count)
+{
+    return chunkBufferSpace(&((SocketWritable *) self)->wbuf, iov, iovmax, count);
+}
+
+/* generic writeCommit() for SocketWritable */
+void socketWritableWriteCommit(Socket *self, size_t count)
+{
+    SocketWritable *sockw = (SocketWritable *) self;
+    int wasEmpty = (sockw->wbuf.used == 0);
+
+    chunkBufferCommit(&sockw->wbuf, count);
+    if (sockw->wbuf.used > sockw->wbufHigh) sockw->wbufHigh = sockw->wbuf.used;
+
+    if (wasEmpty && count)
+        pollUpdate(self);
+}
+
+/* move data from a chunk buffer into a SocketWritable's buffer */
+void socketWritableMove(Socket *self, struct ChunkBuffer *from, size_t count)
+{
+    SocketWritable *sockw = (SocketWritable *) self;
+    int wasEmpty = (sockw->wbuf.used == 0);
+
+    chunkBufferMove(&sockw->wbuf, from, count);
+    if (sockw->wbuf.used > sockw->wbufHigh) sockw->wbufHigh = sockw->wbuf.used;
+
+    if (wasEmpty && count)
+        pollUpdate(self);
+}
+
+/* call this when the other side grants more sending credit */
+void socketCredit(Socket *self, size_t count)
+{
+    int wasOut = (self->credit == 0);
+
+    self->credit += count;
+    if (wasOut)
+        pollUpdate(self);
 }
 
 /* call this when a socket receives data */
 void socketRead(Socket *self, const void *buf, size_t count)
 {
-    unsigned char szbuf[4];
+    self->bytesRead += count;
 
-    /* write our send command */
-    muxCommand(stdoutSocket, 's', self->id);
+    /* the other side has to make room for it */
+    if (count < self->credit) {
+        self->credit -= count;
+    } else {
+        self->credit = 0;
+        pollUpdate(self);
+    }
 
-    /* and the data */
-    muxPrepareInt(szbuf, (int32_t) count);
-    stdoutSocket->vtbl->write(stdoutSocket, szbuf, 4);
-    stdoutSocket->vtbl->write(stdoutSocket, buf, count);
+    /* then wait our turn */
+    schedSend(self, buf, count);
 }
 
-/* construct a socket by name */
+/* may a socket be read now (it has credit, and isn't over a buffer limit)? */
+int socketMayRead(Socket *self)
+{
+    if (!self->credit || socketsLimited) return 0;
+    if (socketBufferMax && self->out.used >= socketBufferMax) return 0;
+    return 1;
+}
+
+/* set how much a socket has buffered, keeping the total up to date */
+static void socketBufferedSet(Socket *self, size_t now)
+{
+    size_t was = socketBuffered;
+
+    socketBuffered = socketBuffered - self->buffered + now;
+    self->buffered = now;
+
+    /* over the total limit, everything holds back (sockets stop polling as
+     * they're next selected), until it's well under again */
+    if (socketBufferTotalMax) {
+        if (socketBuffered >= socketBufferTotalMax) {
+            socketsLimited = 1;
+        } else if (socketsLimited && !socketResumeTimer.when &&
+                   socketBuffered < socketBufferTotalMax - socketBufferTotalMax / 4) {
+            timerSet(&socketResumeTimer, 1);
+        }
+    }
+
+    /* once it's all drained, spare memory can go back after a while */
+    if (was && !socketBuffered) {
+        socketDrainedAt = timerNow();
+        if (socketReclaimDelay && !socketReclaimTimer.when)
+            timerSet(&socketReclaimTimer, socketDrainedAt + socketReclaimDelay * 1000000LL);
+    }
+}
+
+/* call this when a socket's buffers change, to keep socketBuffered (and
+ * whatever depends on it) up to date */
+void socketAccount(Socket *self)
+{
+    size_t now = self->out.used;
+
+    /* (only writable sockets have a wbuf) */
+    if (self->vtbl->write == socketWritableWrite)
+        now += ((SocketWritable *) self)->wbuf.used;
+
+    /* room under its own limit may mean it can be read again */
+    if (socketBufferMax && now < self->buffered)
+        pollUpdate(self);
+
+    socketBufferedSet(self, now);
+}
+
+/* call this after data from the other side is written to a socket: if that
+ * took it over its own buffer limit (which only sending more than it was
+ * granted can), it's closed. Returns 1 if it was. The total limit only holds
+ * back reading and granting, since what was already granted may still come */
+int socketCheckBuffer(Socket *self)
+{
+    size_t wbuf;
+
+    socketAccount(self);
+    if (self->vtbl->write != socketWritableWrite) return 0;
+    wbuf = ((SocketWritable *) self)->wbuf.used;
+
+    if (socketBufferMax && wbuf > socketBufferMax) {
+        fprintf(stderr, "Socket %d is over its buffer limit, closing it.\n", self->id);
+        socketOverflows++;
+        freeSocket(self);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* back under the total buffer limit: read and grant again */
+static void socketResume(Timer *ignore)
+{
+    int slot;
+    Socket *sock;
+
+    if (socketBuffered >= socketBufferTotalMax - socketBufferTotalMax / 4) return;
+    socketsLimited = 0;
+
+    for (slot = 0; slot < sockets.bufused; slot++) {
+        sock = sockets.buf[slot].sock;
+        if (!sock) continue;
+        socketGrant(sock);
+        pollUpdate(sock);
+    }
+}
+
+/* give spare memory back, once nothing has been buffered for a while */
+static void socketReclaim(Timer *ignore)
+{
+    long long due = socketDrainedAt + socketReclaimDelay * 1000000LL;
+
+    /* (busy again, so it'll be set again when it's drained) */
+    if (socketBuffered) return;
+    if (timerNow() < due) {
+        timerSet(&socketReclaimTimer, due);
+        return;
+    }
+
+    slabReclaim();
+    pollReclaim();
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    socketReclaims++;
+}
+
+/* apply comma-separated options to a socket, returning 0 if they're invalid */
+static int socketOptions(SocketOptions *self, char *opts)
+{
+    char *opt, *saveptr;
+
+    for (opt = strtok_r(opts, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr)) {
+        if (!strcmp(opt, "nodelay")) {
+            self->nodelay = 1;
+        } else if (!strcmp(opt, "nocompress")) {
+            self->nocompress = 1;
+        } else if (!strncmp(opt, "prio=", 5)) {
+            self->prio = atoi(opt + 5);
+            if (self->prio < 0 || self->prio > SCHED_PRIO_MAX) {
+                fprintf(stderr, "Priority must be from 0 to %d.\n", SCHED_PRIO_MAX);
+                return 0;
+            }
+        } else if (!strncmp(opt, "backlog=", 8)) {
+            self->backlog = atoi(opt + 8);
+            if (self->backlog < 1) {
+                fprintf(stderr, "Backlog must be at least 1.\n");
+                return 0;
+            }
+        } else if (!strncmp(opt, "pool=", 5)) {
+            self->pool = atoi(opt + 5);
+            if (self->pool < 0 || self->pool > CONNPOOL_MAX) {
+                fprintf(stderr, "Pool size must be from 0 to %d.\n", CONNPOOL_MAX);
+                return 0;
+            }
+        } else if (!strncmp(opt, "pool-idle=", 10)) {
+            self->poolIdle = atoi(opt + 10);
+            if (self->poolIdle < 1) {
+                fprintf(stderr, "Pool idle time must be at least 1 second.\n");
+                return 0;
+            }
+        } else {
+            fprintf(stderr, "Unrecognized socket option %s.\n", opt);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* construct a socket by name (type:parameters[,option...]) */
 Socket *socketByName(char *namePlus)
 {
-    char *name, *saveptr;
+    char *name, *opts, *saveptr, *full;
     NameableSocket *ns;
+    SocketOptions sopts;
+    Socket *ret;
+
+    /* keep the whole spec to name the socket by */
+    SF(full, strdup, NULL, (namePlus));
+
+    /* split off the options, which the constructor may need */
+    opts = strchr(namePlus, ',');
+    if (opts) *opts++ = '\0';
+    memset(&sopts, 0, sizeof(sopts));
+    sopts.backlog = SOCKET_BACKLOG_DEFAULT;
+    sopts.poolIdle = SOCKET_POOL_IDLE_DEFAULT;
+    if (opts && !socketOptions(&sopts, opts)) {
+        free(full);
+        return NULL;
+    }
 
     /* get out the name part */
     name = strtok_r(namePlus, ":", &saveptr);
+    if (name == NULL) return NULL;
 
     /* try to find it */
     for (ns = nameableSockets; ns; ns = ns->next) {
         if (!strcmp(ns->name, name)) {
             /* got it! */
-            return ns->construct(&saveptr);
+            /* only connections that are plain sockets can be pooled */
+            if (sopts.pool && strcmp(name, "tcp4") && strcmp(name, "unix")) {
+                fprintf(stderr, "Only tcp4 and unix sockets can be pooled.\n");
+                free(full);
+                return NULL;
+            }
+
+            ret = ns->construct(&saveptr, &sopts);
+            if (ret) {
+                ret->opts = sopts;
+                ret->name = full;
+                if (sopts.pool) connPoolInit(ret);
+            } else {
+                free(full);
+            }
+            return ret;
         }
     }
 
+    free(full);
     return NULL;
 }
 
+/* accept every waiting connection on a listening socket */
+void socketAccept(Socket *self, int fd, Socket *(*make)(int fd))
+{
+    Socket *sock;
+    size_t accepted;
+    int newfd, id;
+
+    for (accepted = 0; accepted < socketAcceptMax; accepted++) {
+        newfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        sock = make(newfd);
+        socketInherit(sock, self);
+        id = registerSocket(sock, NULL);
+
+        /* tell the other side. Every 'c' from this wakeup goes out together,
+         * once the loop is done */
+        muxCommandInt(MUX_OUT(id), 'c', self->id, id);
+    }
+}
+
 /* get a socket by ID */
 Socket *socketById(int id)
 {
-    if (id < 0 || id >= sockets.bufused) return NULL;
-    return sockets.buf[id];
+    Socket *ret;
+    if (id < 0 || SOCKET_SLOT(id) >= sockets.bufused) return NULL;
+    ret = sockets.buf[SOCKET_SLOT(id)].sock;
+    return (ret && ret->id == id) ? ret : NULL;
 }
 
-/* get the maximum socket ID + 1 */
+/* get the maximum socket slot + 1 */
 int socketCount()
 {
     return sockets.bufused;
 }
 
+/* get the socket in a slot */
+Socket *socketBySlot(int slot)
+{
+    if (slot < 0 || slot >= sockets.bufused) return NULL;
+    return sockets.buf[slot].sock;
+}
+
+/* list or unlist a free slot of our parity */
+static void socketSlotFree(int slot)
+{
+    SocketSlot *ss = &sockets.buf[slot];
+    ss->freePrev = -1;
+    ss->freeNext = socketFree;
+    if (socketFree >= 0) sockets.buf[socketFree].freePrev = slot;
+    socketFree = slot;
+}
+
+static void socketSlotUnfree(int slot)
+{
+    SocketSlot *ss = &sockets.buf[slot];
+    if (ss->freePrev >= 0) sockets.buf[ss->freePrev].freeNext = ss->freeNext;
+    else socketFree = ss->freeNext;
+    if (ss->freeNext >= 0) sockets.buf[ss->freeNext].freePrev = ss->freePrev;
+}
+
+/* grow the socket table to include slot */
+static void socketSlotsTo(int slot)
+{
+    SocketSlot *ss;
+
+    while (slot >= sockets.bufsz) EXPAND_BUFFER(sockets);
+    for (; sockets.bufused <= slot; sockets.bufused++) {
+        ss = &sockets.buf[sockets.bufused];
+        ss->sock = NULL;
+        ss->gen = socketGenSeed;
+        ss->echoWait = 0;
+        if ((sockets.bufused & 1) == socketPreferredId)
+            socketSlotFree(sockets.bufused);
+    }
+}
+
+/* drop free slots off the end of the socket table, and give back memory
+ * once it's mostly unused (after a burst of connections) */
+static void socketSlotsCompact()
+{
+    int slot, gen;
+
+    /* (stdin and stdout always stay) */
+    while (sockets.bufused > 2 && !sockets.buf[sockets.bufused - 1].sock &&
+           !sockets.buf[sockets.bufused - 1].echoWait) {
+        slot = --sockets.bufused;
+
+        /* generations wrap around, so newer is less than half the way round
+         * ahead */
+        gen = sockets.buf[slot].gen;
+        if (((gen - socketGenSeed) & SOCKET_GEN_MASK) <= SOCKET_GEN_MASK / 2)
+            socketGenSeed = gen;
+        if ((slot & 1) == socketPreferredId)
+            socketSlotUnfree(slot);
+    }
+
+    SHRINK_BUFFER(sockets);
+}
+
 /* initialize the socket subsystem */
 void initSockets(int preferredId)
 {
     int forceId;
     INIT_BUFFER(sockets);
+    SF(readBuf, malloc, NULL, (socketReadMax));
+    initPoll();
+    initTimer(&socketResumeTimer, socketResume);
+    initTimer(&socketReclaimTimer, socketReclaim);
 
     socketPreferredId = preferredId;
     nameableSockets = NULL;
@@ -207,44 +722,160 @@ void initSockets(int preferredId)
 /* register a new socket */
 int registerSocket(Socket *socket, const int *forceId)
 {
-    int id;
+    SocketSlot *ss;
+    Socket *moved = NULL;
+    int id, slot;
 
     if (forceId) {
         id = *forceId;
+        slot = SOCKET_SLOT(id);
+
+        /* kill anything that's already there (the other side is already
+         * done with it, or it wouldn't be reusing the slot), except our own
+         * sockets, which the other side knows nothing of, and just move */
+        if (slot < sockets.bufused && sockets.buf[slot].sock) {
+            moved = sockets.buf[slot].sock;
+            if (moved->local) {
+                unregisterSocket(moved);
+            } else {
+                forgetSocket(moved);
+                moved = NULL;
+            }
+        }
+
+        socketSlotsTo(slot);
+        ss = &sockets.buf[slot];
+        if (ss->echoWait)
+            ss->echoWait = 0;
+        else if ((slot & 1) == socketPreferredId)
+            socketSlotUnfree(slot);
+        ss->gen = (id >> SOCKET_SLOT_BITS) + 1;
+
     } else {
-        /* try to find a free ID */
-        for (id = socketPreferredId; id < sockets.bufused && sockets.buf[id]; id += 2);
-    }
+        /* take a free slot, making one if there are none */
+        if (socketFree < 0)
+            socketSlotsTo(sockets.bufused + ((sockets.bufused & 1) != socketPreferredId));
+        slot = socketFree;
+        if (slot > SOCKET_SLOT_MASK) {
+            fprintf(stderr, "Critical error! Out of socket IDs!\n");
+            exit(1);
+        }
+        socketSlotUnfree(slot);
+        ss = &sockets.buf[slot];
+
+        /* older versions index their table by the whole ID, so only use
+         * generations with newer ones */
+        id = slot;
+        if (muxVersion >= 2)
+            id = SOCKET_ID(ss->gen, slot);
+        ss->gen++;
 
-    /* make sure we have the space */
-    while (id >= sockets.bufsz) EXPAND_BUFFER(sockets);
-    for (; sockets.bufused <= id; sockets.bufused++) {
-        sockets.buf[sockets.bufused] = NULL;
     }
 
-    /* kill anything that's already there */
-    if (sockets.buf[id])
-        freeSocket(sockets.buf[id]);
+    ss->gen &= SOCKET_GEN_MASK;
 
     /* then take it */
-    sockets.buf[id] = socket;
+    ss->sock = socket;
     socket->id = id;
 
+    /* and start polling it */
+    pollUpdate(socket);
+
+    if (moved)
+        registerSocket(moved, NULL);
+
     return id;
 }
 
-/* deregister and free a socket */
-void freeSocket(Socket *socket)
+/* take a socket out of the table without destroying it */
+void unregisterSocket(Socket *socket)
 {
+    int slot = SOCKET_SLOT(socket->id);
+
+    pollForget(socket);
+    sockets.buf[slot].sock = NULL;
+    if ((slot & 1) == socketPreferredId)
+        socketSlotFree(slot);
+    socket->id = -1;
+}
+
+/* deregister and free a socket, optionally telling the other side */
+static void destroySocket(Socket *socket, int tell)
+{
+    int slot = SOCKET_SLOT(socket->id);
+    Socket *parent;
+
+    /* anything queued goes out before the disconnect */
+    if (tell)
+        schedFlush(socket);
+    schedDrop(socket);
+
     /* destroy */
+    pollForget(socket);
     if (socket->vtbl->destruct)
         socket->vtbl->destruct(socket);
-    sockets.buf[socket->id] = NULL;
+    socketBufferedSet(socket, 0);
+    sockets.buf[slot].sock = NULL;
+    if ((slot & 1) == socketPreferredId) {
+        /* older versions echo the 'd' we're about to send */
+        if (tell && !socket->local && muxVersion < 2)
+            sockets.buf[slot].echoWait = 1;
+        else
+            socketSlotFree(slot);
+    }
 
     /* then tell the other side */
-    muxCommand(stdoutSocket, 'd', socket->id);
+    if (tell && !socket->local)
+        muxCommand(MUX_OUT(socket->id), 'd', socket->id);
+    if (!socket->local) socketDisconnects++;
+
+    /* our statistics live on in whatever we were connected from */
+    parent = socketById(socket->parentId);
+    if (parent) {
+        parent->bytesRead += socket->bytesRead;
+        parent->bytesWritten += socket->bytesWritten;
+        parent->framesSent += socket->framesSent;
+        parent->framesReceived += socket->framesReceived;
+    }
+
+    slabFree(socket, socket->sz);
 
-    free(socket);
+    socketSlotsCompact();
+}
+
+/* deregister and free a socket */
+void freeSocket(Socket *socket)
+{
+    destroySocket(socket, 1);
+}
+
+/* deregister and free a socket the other side has already disconnected */
+void forgetSocket(Socket *socket)
+{
+    destroySocket(socket, 0);
+}
+
+/* the other side has sent a 'd'. We never echo it (the echo could arrive
+ * after the other side has reused the ID, and kill the new socket), but
+ * older versions do echo ours, so one for a socket we no longer have may be
+ * that echo, after which the slot is free at last (see destroySocket) */
+void socketDisconnected(int id)
+{
+    Socket *sock = socketById(id);
+    int slot = SOCKET_SLOT(id);
+    SocketSlot *ss;
+
+    if (sock) {
+        forgetSocket(sock);
+        return;
+    }
+
+    if (id < 0 || slot >= sockets.bufused) return;
+    ss = &sockets.buf[slot];
+    if (!ss->echoWait || ss->sock) return;
+    ss->echoWait = 0;
+    socketSlotFree(slot);
+    socketSlotsCompact();
 }
 
 /* register a nameable socket */
@@ -253,3 +884,98 @@ void registerNameableSocket(NameableSocket *ns)
     ns->next = nameableSockets;
     nameableSockets = ns;
 }
+
+/* write out a socket's name as a label value */
+static void socketStatsName(FILE *to, Socket *sock)
+{
+    const char *c;
+
+    if (sock == stdinSocket) {
+        fputs("stdin", to);
+        return;
+    } else if (sock == stdoutSocket) {
+        fputs("stdout", to);
+        return;
+    } else if (!sock->name) {
+        return;
+    }
+
+    for (c = sock->name; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', to);
+        fputc(*c, to);
+    }
+}
+
+/* write out statistics (in Prometheus' text format) */
+void socketStats(FILE *to)
+{
+    static const char *const kinds[] = {
+        "bytes_read", "counter", "bytes read from the socket",
+        "bytes_written", "counter", "bytes written to the socket",
+        "frames_sent", "counter", "frames sent to the other side for the socket",
+        "frames_received", "counter", "frames received from the other side for the socket",
+        "queued_bytes", "gauge", "bytes waiting to be sent to the other side",
+        "wbuf_bytes", "gauge", "bytes waiting to be written to the socket",
+        "wbuf_high_bytes", "gauge", "most bytes ever waiting to be written to the socket",
+        NULL
+    };
+    const char *const *kind;
+    unsigned long long val;
+    int slot, k, live = 0;
+    Socket *sock;
+
+    for (slot = 0; slot < sockets.bufused; slot++)
+        if (sockets.buf[slot].sock) live++;
+
+    fprintf(to, "# HELP mudem_sockets Sockets open.\n"
+                "# TYPE mudem_sockets gauge\n"
+                "mudem_sockets %d\n"
+                "# HELP mudem_connects_total Connections made.\n"
+                "# TYPE mudem_connects_total counter\n"
+                "mudem_connects_total %llu\n"
+                "# HELP mudem_disconnects_total Sockets disconnected.\n"
+                "# TYPE mudem_disconnects_total counter\n"
+                "mudem_disconnects_total %llu\n"
+                "# HELP mudem_buffered_bytes Data buffered for every connection together.\n"
+                "# TYPE mudem_buffered_bytes gauge\n"
+                "mudem_buffered_bytes %zu\n"
+                "# HELP mudem_buffer_limited Whether connections are held back for the total buffer limit.\n"
+                "# TYPE mudem_buffer_limited gauge\n"
+                "mudem_buffer_limited %d\n"
+                "# HELP mudem_buffer_overflows_total Connections closed for going over their buffer limit.\n"
+                "# TYPE mudem_buffer_overflows_total counter\n"
+                "mudem_buffer_overflows_total %llu\n"
+                "# HELP mudem_reclaims_total Times spare memory was given back.\n"
+                "# TYPE mudem_reclaims_total counter\n"
+                "mudem_reclaims_total %llu\n",
+            live, socketConnects, socketDisconnects, socketBuffered,
+            socketsLimited, socketOverflows, socketReclaims);
+
+    for (kind = kinds, k = 0; *kind; kind += 3, k++) {
+        fprintf(to, "# HELP mudem_socket_%s Per socket: %s.\n"
+                    "# TYPE mudem_socket_%s %s\n",
+                kind[0], kind[2], kind[0], kind[1]);
+
+        for (slot = 0; slot < sockets.bufused; slot++) {
+            sock = sockets.buf[slot].sock;
+            if (!sock) continue;
+
+            switch (k) {
+                case 0: val = sock->bytesRead; break;
+                case 1: val = sock->bytesWritten; break;
+                case 2: val = sock->framesSent; break;
+                case 3: val = sock->framesReceived; break;
+                case 4: val = sock->out.used; break;
+                default:
+                    /* only writable sockets have a wbuf */
+                    if (sock->vtbl->write != socketWritableWrite) continue;
+                    val = (k == 5) ? ((SocketWritable *) sock)->wbuf.used :
+                                     ((SocketWritable *) sock)->wbufHigh;
+            }
+
+            fprintf(to, "mudem_socket_%s{id=\"%d\",socket=\"", kind[0], sock->id);
+            socketStatsName(to, sock);
+            fprintf(to, "\"} %llu\n", val);
+        }
+    }
+}
@@ -17,16 +17,28 @@
 #ifndef MUXSOCKET_H
 #define MUXSOCKET_H
 
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #include "buffer.h"
+#include "chunkbuf.h"
+#include "timer.h"
 
 typedef struct _SocketVTbl SocketVTbl;
 typedef struct _Socket Socket;
 typedef struct _SocketWritable SocketWritable;
 typedef struct _NameableSocket NameableSocket;
+typedef struct _SocketOptions SocketOptions;
 
-BUFFER(Socket, Socket *);
+/* socket IDs are a slot in the socket table, plus a generation in the high
+ * bits so that a reused slot doesn't get frames meant for its last user.
+ * Each side allocates slots of its own parity (see initSockets) */
+#define SOCKET_SLOT_BITS 20
+#define SOCKET_SLOT_MASK ((1 << SOCKET_SLOT_BITS) - 1)
+#define SOCKET_GEN_MASK (0x7FFFFFFF >> SOCKET_SLOT_BITS)
+#define SOCKET_SLOT(id) ((id) & SOCKET_SLOT_MASK)
+#define SOCKET_ID(gen, slot) (((gen) << SOCKET_SLOT_BITS) | (slot))
 
 /* vtbl for sockets */
 struct _SocketVTbl {
@@ -36,7 +48,8 @@ struct _SocketVTbl {
     /* connect to a connectable socket; returns a new socket ID */
     Socket *(*connect)(Socket *self);
 
-    /* called to determine whether to select() over this socket */
+    /* called to determine which FDs to poll for this socket. The answer is
+     * remembered, so anything that changes it must call pollUpdate */
     void (*shouldSelect)(Socket *self, int *r, int *w);
 
     /* called when this socket is selected for read (must be set only if
@@ -49,42 +62,158 @@ struct _SocketVTbl {
 
     /* write into buffer */
     void (*write)(Socket *self, const void *buf, size_t count);
+
+    /* optionally, get space at the end of the buffer to fill directly, as
+     * iovecs, and commit what was filled (see chunkBufferSpace) */
+    int (*writeSpace)(Socket *self, struct iovec *iov, int iovmax, size_t count);
+    void (*writeCommit)(Socket *self, size_t count);
+};
+
+/* per-socket options, given after the socket spec and inherited by every
+ * connection made from it */
+struct _SocketOptions {
+    /* never hold back small sends to coalesce them */
+    int nodelay;
+
+    /* scheduling priority class (0 to SCHED_PRIO_MAX, higher first) */
+    int prio;
+
+    /* never compress this socket's data */
+    int nocompress;
+
+    /* how many connections a listening socket may have waiting */
+    int backlog;
+
+    /* how many connections to make ahead of time (see connpool.h), and how
+     * long (in seconds) one may wait unused before it's replaced */
+    int pool, poolIdle;
 };
 
+/* the default backlog for listening sockets */
+#define SOCKET_BACKLOG_DEFAULT SOMAXCONN
+
+/* the default for how long a pooled connection may wait unused */
+#define SOCKET_POOL_IDLE_DEFAULT 60
+
+/* the default for how long (in seconds) buffers must stay empty before spare
+ * memory is given back */
+#define SOCKET_RECLAIM_DELAY_DEFAULT 10
+
 /* base type for all sockets */
 struct _Socket {
     size_t sz;
     SocketVTbl *vtbl;
     int id;
+
+    /* FDs currently being polled for read and write */
+    int pollR, pollW;
+
+    /* how much socketSelectedR currently reads at once */
+    size_t readSize;
+
+    /* how much more we may send before the other side grants more, and how
+     * much we've written out but not yet granted back */
+    size_t credit, owed;
+
+    SocketOptions opts;
+
+    /* the spec this socket (or the socket it was connected from) was made
+     * from, for statistics, and whether it's ours alone (the other side is
+     * never told about it) */
+    const char *name;
+    int local;
+
+    /* statistics: bytes read from and written to this socket, and frames
+     * sent and received for it (including those of closed connections made
+     * from it, which are added in when they close) */
+    unsigned long long bytesRead, bytesWritten, framesSent, framesReceived;
+    int parentId;
+
+    /* data waiting to be sent to the other side, and when to stop holding it
+     * back to coalesce it */
+    struct ChunkBuffer out;
+    Timer holdTimer;
+
+    /* our place in line to send (see muxsched.c) */
+    Socket *schedPrev, *schedNext;
+    size_t deficit;
+
+    /* frames to send uncompressed before trying compression again, and how
+     * many to skip the next time it doesn't pay off */
+    unsigned int zSkip, zBackoff;
+
+    /* how much of socketBuffered is ours (see socketAccount) */
+    size_t buffered;
 };
 
 /* base type for buffered writable sockets */
 struct _SocketWritable {
     Socket ssuper;
     int fd;
-    struct Buffer_char wbuf;
+    struct ChunkBuffer wbuf;
+
+    /* the most that's ever been waiting in wbuf */
+    size_t wbufHigh;
+
+    /* still connecting (data for it is buffered until it's done) */
+    int connecting;
 };
 
 /* a nameable socket type, for arg-specified sockets */
 struct _NameableSocket {
     NameableSocket *next;
     const char *name;
-    Socket *(*construct)(char **saveptr);
+    Socket *(*construct)(char **saveptr, SocketOptions *opts);
 };
 
+/* the largest read socketSelectedR will do at once */
+extern size_t socketReadMax;
+
+/* how much socketSelectedR will read from one socket in one wakeup */
+extern size_t socketReadBudget;
+
+/* the most connections socketAccept will accept at once */
+extern size_t socketAcceptMax;
+
+/* coalesce sends smaller than this many bytes (0 to never coalesce) */
+extern size_t socketCoalesceBytes;
+
+/* and hold them back at most this many microseconds */
+extern size_t socketCoalesceDelay;
+
+/* the most data that may be buffered for one connection, and for every
+ * connection together (0 for no limit) */
+extern size_t socketBufferMax, socketBufferTotalMax;
+
+/* how much data is buffered for every connection together */
+extern size_t socketBuffered;
+
+/* give back spare memory once nothing has been buffered for this many
+ * seconds (0 to never) */
+extern size_t socketReclaimDelay;
+
 /* base constructor for all sockets */
 Socket *newSocket(size_t sz);
 
+/* copy options (and the name) from the socket a connection was made from */
+void socketInherit(Socket *self, Socket *parent);
+
 /* super-constructor for writable sockets */
 void newSocketWritable(SocketWritable *self, int fd);
 
+/* connect a SocketWritable's fd without blocking. Returns -1 if it failed
+ * already; otherwise it finishes when the fd is writable, and the socket is
+ * freed (telling the other side) if it fails */
+int socketWritableConnect(SocketWritable *self, const struct sockaddr *addr, socklen_t addrlen);
+
 /* generic destruct() for SocketWritable */
 void socketWritableDestruct(Socket *self);
 
 /* generic shouldSelect() for SocketWritable */
 void socketWritableShouldSelect(Socket *self, int *r, int *w);
 
-/* generic shouldSelect() for SocketWritables which are also readable */
+/* generic shouldSelect() for SocketWritables which are also readable (while
+ * they have sending credit) */
 void socketWritableShouldSelectR(Socket *self, int *r, int *w);
 
 /* generic selectedR() for any socket that uses simple FDs */
@@ -96,18 +225,56 @@ int socketWritableSelectedW(Socket *self, int fd);
 /* generic write() for SocketWritable */
 void socketWritableWrite(Socket *self, const void *buf, size_t count);
 
+/* generic writeSpace() for SocketWritable */
+int socketWritableWriteSpace(Socket *self, struct iovec *iov, int iovmax, size_t count);
+
+/* generic writeCommit() for SocketWritable */
+void socketWritableWriteCommit(Socket *self, size_t count);
+
+/* move data from a chunk buffer into a SocketWritable's buffer */
+void socketWritableMove(Socket *self, struct ChunkBuffer *from, size_t count);
+
+/* call this when the other side grants more sending credit */
+void socketCredit(Socket *self, size_t count);
+
 /* call this when a socket receives data */
 void socketRead(Socket *self, const void *buf, size_t count);
 
-/* construct a socket by name */
+/* may a socket be read now (it has credit, and isn't over a buffer limit)? */
+int socketMayRead(Socket *self);
+
+/* call this when a socket's buffers change, to keep socketBuffered (and
+ * whatever depends on it) up to date */
+void socketAccount(Socket *self);
+
+/* call this after data from the other side is written to a socket: if that
+ * took it over its own buffer limit, it's closed. Returns 1 if it was */
+int socketCheckBuffer(Socket *self);
+
+/* take a socket out of the table without destroying it, to register it
+ * again under another ID */
+void unregisterSocket(Socket *socket);
+
+/* accept every waiting connection (up to socketAcceptMax) on a listening
+ * socket's fd, making a socket of each with make, and tell the other side
+ * about them */
+void socketAccept(Socket *self, int fd, Socket *(*make)(int fd));
+
+/* construct a socket by name (type:parameters[,option...]) */
 Socket *socketByName(char *name);
 
 /* get a socket by ID */
 Socket *socketById(int id);
 
-/* get the maximum socket ID + 1 */
+/* get the maximum socket slot + 1 */
 int socketCount();
 
+/* get the socket in a slot */
+Socket *socketBySlot(int slot);
+
+/* write out statistics */
+void socketStats(FILE *to);
+
 /* initialize the socket subsystem */
 void initSockets(int preferredId);
 
@@ -117,6 +284,14 @@ int registerSocket(Socket *socket, const int *forceId);
 /* deregister and free a socket */
 void freeSocket(Socket *socket);
 
+/* deregister and free a socket the other side has already disconnected (so
+ * that no 'd' is echoed back to race with reuse of its ID) */
+void forgetSocket(Socket *socket);
+
+/* the other side has disconnected a socket (or, if it's an older version,
+ * echoed our own 'd' for one) */
+void socketDisconnected(int id);
+
 /* register a nameable socket */
 void registerNameableSocket(NameableSocket *ns);
 
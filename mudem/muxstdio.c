@@ -14,10 +14,113 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
 
+#include "connpool.h"
+#include "lz.h"
+#include "metrics.h"
+#include "muxpoll.h"
+#include "muxsched.h"
 #include "muxstdio.h"
+#include "timer.h"
+
+/* how much of the input channel we read at once */
+#define MUX_INPUT_SIZE 65536
+
+/* payloads at least this large are read directly into their socket's
+ * buffer, rather than through ours */
+#define MUX_DIRECT_MIN 4096
+
+/* the protocol version in use */
+int muxVersion = 1;
+
+/* the features we offer, and those the other side offered */
+int muxFeatures = MUX_FEATURE_PING, muxPeerFeatures;
+
+/* the largest frame payload and the per-stream window the other side
+ * accepts */
+size_t muxPeerFrameMax = SIZE_MAX, muxPeerWindow = SIZE_MAX;
+
+/* the window we give the other side on each stream */
+size_t muxWindow = MUX_WINDOW;
+
+/* how often to ping the other side on each channel, in milliseconds */
+size_t muxPingInterval = 0;
+
+/* the longest capabilities string we'll accept */
+#define MUX_CAPS_MAX 256
+
+/* the marker that ends the handshake. Anything before it is discarded, so
+ * stray handshake bytes can never be taken for frames */
+#define MUX_SYNC "[mudem sync]C"
+
+/* the first wait for the other side to answer our hello (in microseconds),
+ * the longest wait (to which it doubles), and how many hellos we send before
+ * giving up (about a minute's worth) */
+#define MUX_HELLO_WAIT_MIN 1000
+#define MUX_HELLO_WAIT_MAX 250000
+#define MUX_HELLO_TRIES 250
+
+/* how long the handshake took, in microseconds */
+long long muxHandshakeTime;
+
+/* a bracketed block of handshake text (capabilities or the sync marker) as
+ * it arrives (capsLen is -1 outside of one), whether one ended just before
+ * the byte last read, and whether one ended with the byte last read */
+static char capsBuf[MUX_CAPS_MAX];
+static int capsLen = -1, capsSeen = 0, capsClosed = 0;
+
+/* where 'z' payloads are decompressed */
+static unsigned char zBuf[MUX_COMPRESS_MAX];
+
+/* an input channel, with its buffered input from the other side
+ * (buf[start..end) is unparsed), the socket receiving the current 's'
+ * payload (-1 to discard it), and how much of that payload is yet to come.
+ * Extra channels discard everything up to the other side's sync marker;
+ * syncLen is how much of it we've seen, or -1 once we have */
+typedef struct _MuxInput MuxInput;
+struct _MuxInput {
+    Socket ssuper;
+    MuxTransport *transport;
+    int channel;
+    size_t start, end;
+    int payloadId;
+    size_t payloadLeft;
+    int syncLen;
+    unsigned char buf[MUX_INPUT_SIZE];
+};
+
+/* an output channel. If its transport uses a doorbell, there's nothing to
+ * poll until a write has found it full (blocked), so until then, writes are
+ * tried at the end of each wakeup by flushTimer. One frame at a time is timed
+ * from being queued (at markWhen, 0 if none is) until everything up to markAt
+ * is written, into queueDelay. pingTimer sends pings, and the round trips of
+ * their pongs (which come back on the matching input channel) go in rtt */
+typedef struct _MuxOutput MuxOutput;
+struct _MuxOutput {
+    SocketWritable ssuper;
+    MuxTransport *transport;
+    int channel, blocked;
+    Timer flushTimer, pingTimer;
+    long long markWhen;
+    unsigned long long markAt;
+    Histogram queueDelay, rtt;
+};
+
+/* the channels in use, and every channel's transport and input and output
+ * socket */
+int muxChannels = 1;
+MuxTransport *muxTransports[MUX_CHANNELS_MAX];
+Socket *muxIn[MUX_CHANNELS_MAX], *muxOut[MUX_CHANNELS_MAX];
+
+/* the channels we have (including channel 0) */
+static int muxChannelsOpen = 1;
 
 /* put an int into a char[4] */
 void muxPrepareInt(unsigned char *buf, int32_t i)
@@ -28,145 +131,770 @@ void muxPrepareInt(unsigned char *buf, int32_t i)
     buf[3] = i & 0xFF;
 }
 
+/* put a varint into buf, returning its length */
+static size_t muxPutVarint(unsigned char *buf, uint32_t v)
+{
+    size_t len = 0;
+
+    while (v >= 0x80) {
+        buf[len++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+
+    return len;
+}
+
+/* encode a frame header with nvals integers into buf, returning its length */
+static size_t muxHeader(unsigned char *buf, char command, int nvals, int32_t id, int32_t val)
+{
+    size_t len = 1;
+
+    buf[0] = command;
+    if (muxVersion < 2) {
+        muxPrepareInt(buf + 1, id);
+        if (nvals > 1) muxPrepareInt(buf + 5, val);
+        return 1 + 4 * nvals;
+    }
+
+    len += muxPutVarint(buf + len, (uint32_t) id);
+    if (nvals > 1) len += muxPutVarint(buf + len, (uint32_t) val);
+
+    return len;
+}
+
+/* start timing a frame just queued on an output channel, unless one already
+ * is being timed */
+static void muxOutputMark(Socket *sock)
+{
+    MuxOutput *out = (MuxOutput *) sock;
+
+    if (out->markWhen) return;
+    out->markWhen = timerNow();
+    out->markAt = sock->bytesWritten + out->ssuper.wbuf.used;
+}
+
+/* an output channel has written more; time the frame being timed, if it's
+ * all been written */
+static void muxOutputWritten(Socket *sock)
+{
+    MuxOutput *out = (MuxOutput *) sock;
+
+    if (!out->markWhen || sock->bytesWritten < out->markAt) return;
+    histogramObserve(&out->queueDelay, timerNow() - out->markWhen);
+    out->markWhen = 0;
+}
+
 /* helpers */
 void muxCommand(Socket *sock, char command, int32_t i)
 {
-    unsigned char buf[5];
+    unsigned char buf[11];
+    size_t len = muxHeader(buf, command, 1, i, 0);
 
-    buf[0] = command;
-    muxPrepareInt(buf + 1, i);
+    if (sock->vtbl->write) {
+        sock->vtbl->write(sock, buf, len);
+        sock->framesSent++;
+        muxOutputMark(sock);
+    }
+}
 
-    if (sock->vtbl->write)
-        sock->vtbl->write(sock, buf, 5);
+void muxCommandInt(Socket *sock, char command, int32_t i, int32_t val)
+{
+    unsigned char buf[11];
+    size_t len = muxHeader(buf, command, 2, i, val);
+
+    if (sock->vtbl->write) {
+        sock->vtbl->write(sock, buf, len);
+        sock->framesSent++;
+        muxOutputMark(sock);
+    }
 }
 
-static ssize_t readAll(int fd, void *buf, size_t count)
+/* get an int out of a char[4] */
+static int32_t muxGetInt(const unsigned char *buf)
 {
-    ssize_t rd, ird;
-    rd = 0;
-    while (rd < count) {
-        ird = read(fd, (char *) buf + rd, count - rd);
-        if (ird <= 0)
-            return -1;
-        rd += ird;
+    return ((int32_t) buf[0] << 24) | ((int32_t) buf[1] << 16) |
+           ((int32_t) buf[2] << 8) | (int32_t) buf[3];
+}
+
+/* get a varint out of buf, returning its length, 0 if it's incomplete, or -1
+ * if it's invalid */
+static ssize_t muxGetVarint(const unsigned char *buf, size_t count, uint32_t *v)
+{
+    size_t len;
+
+    *v = 0;
+    for (len = 0; len < 5; len++) {
+        if (len >= count) return 0;
+        *v |= (uint32_t) (buf[len] & 0x7F) << (7 * len);
+        if (!(buf[len] & 0x80)) {
+            /* the fifth byte only has four bits to give */
+            if (len == 4 && buf[len] > 0x0F) return -1;
+            return len + 1;
+        }
     }
-    return rd;
+
+    return -1;
+}
+
+/* decode the nvals integers of the frame header at the start of buf,
+ * returning the header's length, 0 if it's incomplete, or -1 if it's
+ * invalid */
+static ssize_t muxGetHeader(const unsigned char *buf, size_t count, int nvals, uint32_t *vals)
+{
+    ssize_t len = 1, vlen;
+    int i;
+
+    if (muxVersion < 2) {
+        if (count < 1 + 4 * nvals) return 0;
+        for (i = 0; i < nvals; i++)
+            vals[i] = (uint32_t) muxGetInt(buf + 1 + 4 * i);
+        return 1 + 4 * nvals;
+    }
+
+    for (i = 0; i < nvals; i++) {
+        vlen = muxGetVarint(buf + len, count - len, vals + i);
+        if (vlen <= 0) return vlen;
+        len += vlen;
+    }
+
+    return len;
+}
+
+/* our capabilities, as sent during the handshake. Older versions skip past
+ * them, so they must never contain 'A', 'B' or 'C' */
+static int muxCapabilities(char *buf, size_t sz)
+{
+    return snprintf(buf, sz, "[mudem v%d m%d f%d w%d c%d]", MUX_VERSION,
+                    MUX_FRAME_MAX, muxFeatures, (int) muxWindow, muxChannelsOpen);
+}
+
+/* adopt the other side's capabilities from capsBuf, if it sent any */
+static void muxPeerCapabilities()
+{
+    const char *c = capsBuf;
+    char *end;
+    unsigned long val, version = 1, frameMax = MUX_FRAME_MAX, features = 0,
+                  window = MUX_WINDOW, channels = 1;
+
+    if (!capsSeen || strncmp(c, "mudem", 5)) return;
+
+    /* they're space-separated, each a letter then a number, and anything
+     * we don't know about is ignored */
+    for (c += 5; *c == ' '; c = end) {
+        c++;
+        if (!*c) break;
+        val = strtoul(c + 1, &end, 10);
+        switch (*c) {
+            case 'v': version = val; break;
+            case 'm': frameMax = val; break;
+            case 'f': features = val; break;
+            case 'w': window = val; break;
+            case 'c': channels = val; break;
+        }
+        while (*end && *end != ' ') end++;
+    }
+
+    if (version < 2 || frameMax == 0 || window == 0) return;
+
+    muxVersion = (version < MUX_VERSION) ? version : MUX_VERSION;
+    muxPeerFrameMax = frameMax;
+    muxPeerFeatures = features;
+    muxPeerWindow = window;
+    if (channels > 0)
+        muxChannels = (channels < muxChannelsOpen) ? channels : muxChannelsOpen;
+}
+
+/* read a byte of handshake, watching for bracketed blocks on the way */
+static char muxHandshakeByte()
+{
+    char c;
+    ssize_t rd;
+
+    while ((rd = muxTransportRead(muxTransports[0], &c, 1)) < 0) {
+        if (errno == EAGAIN)
+            muxTransportWait(muxTransports[0], 0, -1);
+        else if (errno != EINTR)
+            break;
+    }
+    if (rd <= 0) {
+        fprintf(stderr, "Critical error! Lost stdin during handshake!\n");
+        exit(1);
+    }
+
+    capsSeen = 0;
+    if (c == '[') {
+        capsLen = 0;
+    } else if (capsLen >= 0) {
+        if (c == ']') {
+            capsBuf[capsLen] = '\0';
+            capsLen = -1;
+            capsClosed = 1;
+            return c;
+        } else if (capsLen < MUX_CAPS_MAX - 1) {
+            capsBuf[capsLen++] = c;
+        } else {
+            capsLen = -1;
+        }
+    } else {
+        capsSeen = capsClosed;
+    }
+    capsClosed = 0;
+
+    return c;
+}
+
+/* write all of a handshake message */
+static void muxHandshakeWrite(const char *buf, size_t count)
+{
+    ssize_t wr;
+
+    while (count) {
+        wr = muxTransportWrite(muxTransports[0], buf, count);
+        if (wr < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "Critical error! Lost stdout during handshake!\n");
+                exit(1);
+            }
+            muxTransportWait(muxTransports[0], 1, 1000000);
+            continue;
+        }
+        buf += wr;
+        count -= wr;
+    }
+}
+
+/* perform the handshake on channel 0. Side 1 says hello ('A') with
+ * backoff until side 0 answers ('B'), then both sync up ('C'). Each side
+ * sends its capabilities just before its 'A' or 'B', where older versions
+ * ignore them, so the protocol is only upgraded if both sides sent them */
+void muxHandshake(int preferredId)
+{
+    char caps[MUX_CAPS_MAX + 1];
+    int capsSz, tries;
+    long long start, now, deadline, wait;
+
+    start = timerNow();
+    capsSz = muxCapabilities(caps, sizeof(caps) - 1);
+
+    if (preferredId == 1) {
+        /* say hello until they answer */
+        caps[capsSz] = 'A';
+        wait = MUX_HELLO_WAIT_MIN;
+        for (tries = 0; ; tries++) {
+            if (tries == MUX_HELLO_TRIES) {
+                fprintf(stderr, "Critical error! No answer to handshake!\n");
+                exit(1);
+            }
+
+            /* a hello that doesn't fit is as good as lost */
+            muxTransportWrite(muxTransports[0], caps, capsSz + 1);
+
+            deadline = timerNow() + wait;
+            while ((now = timerNow()) < deadline) {
+                if (muxTransportWait(muxTransports[0], 0, deadline - now) &&
+                    muxHandshakeByte() == 'B')
+                    goto answered;
+            }
+
+            wait *= 2;
+            if (wait > MUX_HELLO_WAIT_MAX) wait = MUX_HELLO_WAIT_MAX;
+        }
+answered:
+        muxPeerCapabilities();
+
+        /* then finalize with a 'C', after a marker that tells newer
+         * versions it's really the end */
+        muxHandshakeWrite(MUX_SYNC, sizeof(MUX_SYNC) - 1);
+
+    } else {
+        /* start by waiting for a hello */
+        while (muxHandshakeByte() != 'A');
+        muxPeerCapabilities();
+
+        /* then answer it */
+        caps[capsSz] = 'B';
+        muxHandshakeWrite(caps, capsSz + 1);
+
+        /* and wait for the 'C' that ends the handshake. If they're new
+         * enough to negotiate, only the one right after the sync marker
+         * counts */
+        while (muxHandshakeByte() != 'C' ||
+               (muxVersion >= 2 && (!capsSeen || strcmp(capsBuf, "mudem sync"))));
+
+    }
+
+    /* now we know what the other side can take */
+    if (schedFrameMax > muxPeerFrameMax) schedFrameMax = muxPeerFrameMax;
+
+    muxHandshakeTime = timerNow() - start;
 }
 
-static int32_t getint()
+/* write out statistics (in Prometheus' text format) */
+void muxStats(FILE *to)
 {
-    int32_t val;
-    unsigned char c;
+    char labels[32];
     int i;
 
-    val = 0;
-    for (i = 0; i < 4; i++) {
-        val <<= 8;
-        readAll(0, &c, 1);
-        val |= c;
+    fprintf(to, "# HELP mudem_protocol_version Protocol version in use.\n"
+                "# TYPE mudem_protocol_version gauge\n"
+                "mudem_protocol_version %d\n"
+                "# HELP mudem_handshake_seconds How long the handshake took.\n"
+                "# TYPE mudem_handshake_seconds gauge\n"
+                "mudem_handshake_seconds %.6f\n"
+                "# HELP mudem_channels Channels in use.\n"
+                "# TYPE mudem_channels gauge\n"
+                "mudem_channels %d\n",
+            muxVersion, muxHandshakeTime / 1000000.0, muxChannels);
+
+    fprintf(to, "# HELP mudem_channel_transport What each channel runs over.\n"
+                "# TYPE mudem_channel_transport gauge\n");
+    for (i = 0; i < muxChannels; i++)
+        fprintf(to, "mudem_channel_transport{channel=\"%d\",transport=\"%s\"} 1\n",
+                i, muxTransports[i]->name);
+
+    fprintf(to, "# HELP mudem_channel_queue_delay_seconds How long frames waited to be written to each channel.\n"
+                "# TYPE mudem_channel_queue_delay_seconds histogram\n");
+    for (i = 0; i < muxChannels; i++) {
+        snprintf(labels, sizeof(labels), "channel=\"%d\"", i);
+        histogramWrite(to, "mudem_channel_queue_delay_seconds", labels,
+                       &((MuxOutput *) muxOut[i])->queueDelay);
     }
 
-    return val;
+    fprintf(to, "# HELP mudem_channel_rtt_seconds Round trips of pings over each channel.\n"
+                "# TYPE mudem_channel_rtt_seconds histogram\n");
+    for (i = 0; i < muxChannels; i++) {
+        snprintf(labels, sizeof(labels), "channel=\"%d\"", i);
+        histogramWrite(to, "mudem_channel_rtt_seconds", labels,
+                       &((MuxOutput *) muxOut[i])->rtt);
+    }
 }
 
-/* vtbl for stdin: */
-static void stdinShouldSelect(Socket *self, int *r, int *w);
-static int stdinSelectedR(Socket *self, int fd);
+/* vtbl for input channels: */
+static void muxInputShouldSelect(Socket *self, int *r, int *w);
+static int muxInputSelectedR(Socket *self, int fd);
 
-static SocketVTbl stdinVTbl = {
-    NULL, NULL, stdinShouldSelect, stdinSelectedR, NULL, NULL
+static SocketVTbl muxInputVTbl = {
+    NULL, NULL, muxInputShouldSelect, muxInputSelectedR, NULL, NULL, NULL,
+    NULL
 };
 
-/* vtbl for stdout: */
-static SocketVTbl stdoutVTbl = {
-    socketWritableDestruct, NULL, socketWritableShouldSelect, NULL,
-    socketWritableSelectedW, socketWritableWrite
+/* vtbl for output channels: */
+static void muxOutputShouldSelect(Socket *self, int *r, int *w);
+static int muxOutputSelectedW(Socket *self, int fd);
+static void muxOutputFlush(Timer *timer);
+static void muxOutputPing(Timer *timer);
+
+static SocketVTbl muxOutputVTbl = {
+    socketWritableDestruct, NULL, muxOutputShouldSelect, muxOutputSelectedW,
+    muxOutputSelectedW, socketWritableWrite, socketWritableWriteSpace,
+    socketWritableWriteCommit
 };
 
-/* stdin */
-Socket *newStdinSocket()
+/* run channel 0 over another transport than stdin/stdout */
+void muxUseTransport(MuxTransport *transport)
+{
+    muxTransports[0] = transport;
+}
+
+/* an input channel */
+static MuxInput *newMuxInput(int channel)
 {
-    Socket *ret = newSocket(sizeof(Socket));
-    ret->vtbl = &stdinVTbl;
+    MuxInput *ret = (MuxInput *) newSocket(sizeof(MuxInput));
+    ret->ssuper.vtbl = &muxInputVTbl;
+    ret->transport = muxTransports[channel];
+    ret->channel = channel;
+    ret->start = ret->end = 0;
+    ret->payloadId = -1;
+    ret->payloadLeft = 0;
+    ret->syncLen = channel ? 0 : -1;
+    muxIn[channel] = (Socket *) ret;
     return ret;
 }
 
-static void stdinShouldSelect(Socket *self, int *r, int *w)
+/* stdin (or channel 0's other transport) */
+Socket *newStdinSocket()
 {
-    *r = 0;
+    if (!muxTransports[0])
+        muxTransports[0] = newMuxTransportFd(0, 1);
+    return (Socket *) newMuxInput(0);
+}
+
+static void muxInputShouldSelect(Socket *self, int *r, int *w)
+{
+    *r = ((MuxInput *) self)->transport->rfd;
     *w = -1;
 }
 
-static int stdinSelectedR(Socket *self, int fd)
+/* handle one frame at the start of buf, returning the number of bytes of it
+ * consumed, 0 if the frame is incomplete, or -1 on a critical error. 's'
+ * frames only consume their header; the payload follows in payloadLeft */
+static ssize_t muxFrame(MuxInput *in, const unsigned char *buf, size_t count)
 {
-    char command;
-    int id, cid;
-    ssize_t ct;
+    uint32_t vals[2];
+    ssize_t hlen;
+    int nvals, id, cid;
     Socket *sock, *csock;
-    char *buf;
 
-    if (readAll(0, &command, 1) != 1) {
-        fprintf(stderr, "Critical error! Lost stdin!\n");
-        return 1;
+    switch (buf[0]) {
+        case 'd':
+            nvals = 1;
+            break;
+
+        case 'c':
+        case 's':
+            nvals = 2;
+            break;
+
+        case 'p':
+        case 'q':
+            if (muxVersion >= 2) {
+                nvals = 1;
+                break;
+            }
+            /* fall through */
+
+        case 'w':
+        case 'z':
+            if (muxVersion >= 2) {
+                nvals = 2;
+                break;
+            }
+            /* fall through */
+
+        default:
+            fprintf(stderr, "Critical error! Unrecognized command %d!\n", (int) buf[0]);
+            return -1;
     }
-    id = getint();
+
+    hlen = muxGetHeader(buf, count, nvals, vals);
+    if (hlen < 0)
+        fprintf(stderr, "Critical error! Bad frame header!\n");
+    if (hlen <= 0) return hlen;
+    id = (int32_t) vals[0];
     sock = socketById(id);
-    if (sock == NULL) return 0;
+    in->ssuper.framesReceived++;
 
-    switch (command) {
+    switch (buf[0]) {
         case 'c':
-            cid = getint();
+            cid = (int32_t) vals[1];
+            if (sock == NULL) return hlen;
             if (!sock->vtbl->connect) {
                 fprintf(stderr, "Received a connection request to unconnectable socket %d!\n", id);
-                return 0;
+                return hlen;
             }
-            csock = sock->vtbl->connect(sock);
+            csock = connPoolConnect(sock);
             if (!csock) {
                 fprintf(stderr, "Failed to connect to socket %d.\n", id);
-                muxCommand(stdoutSocket, 'd', cid);
-                return 0;
+                muxCommand(MUX_OUT(cid), 'd', cid);
+                return hlen;
             }
+            socketInherit(csock, sock);
             registerSocket(csock, &cid);
-            break;
+            return hlen;
 
         case 'd':
-            freeSocket(sock);
-            break;
+            socketDisconnected(id);
+            return hlen;
+
+        case 'w':
+            if (sock) socketCredit(sock, vals[1]);
+            return hlen;
+
+        case 'p':
+            /* answer on the same channel, so it's that channel timed */
+            muxCommand(muxOut[in->channel], 'q', id);
+            return hlen;
+
+        case 'q':
+            /* our timestamp back, which may have wrapped around since */
+            histogramObserve(&((MuxOutput *) muxOut[in->channel])->rtt,
+                             (uint32_t) ((uint32_t) timerNow() - vals[0]));
+            return hlen;
 
         case 's':
-            ct = (size_t) getint();
-            SF(buf, malloc, NULL, (ct));
-            /* read it in */
-            if (readAll(0, buf, ct) != ct) {
-                free(buf);
-                muxCommand(stdoutSocket, 'd', id);
-                fprintf(stderr, "Short send!\n");
-                return 0;
+            in->payloadLeft = vals[1];
+            in->payloadId = id;
+            if (sock) sock->framesReceived++;
+            if (sock && !sock->vtbl->write) {
+                muxCommand(MUX_OUT(id), 'd', id);
+                fprintf(stderr, "Send to unwritable socket %d!\n", id);
+                in->payloadId = -1;
+            }
+            return hlen;
+
+        case 'z':
+        {
+            size_t len, rawlen;
+            long zlen;
+
+            /* compressed frames are handled whole, so must fit our buffer */
+            len = vals[1];
+            if (len < 4 || len > MUX_INPUT_SIZE - hlen) {
+                fprintf(stderr, "Critical error! Bad compressed frame size %d!\n", (int) len);
+                return -1;
+            }
+            if (count < hlen + len) return 0;
+
+            rawlen = (uint32_t) muxGetInt(buf + hlen);
+            zlen = -1;
+            if (rawlen <= MUX_COMPRESS_MAX)
+                zlen = lzDecompress(buf + hlen + 4, len - 4, zBuf, rawlen);
+            if (zlen != (long) rawlen) {
+                fprintf(stderr, "Critical error! Corrupt compressed frame!\n");
+                return -1;
             }
-            if (!sock->vtbl->write) {
-                free(buf);
-                muxCommand(stdoutSocket, 'd', id);
+
+            if (sock && !sock->vtbl->write) {
+                muxCommand(MUX_OUT(id), 'd', id);
                 fprintf(stderr, "Send to unwritable socket %d!\n", id);
-                return 0;
+            } else if (sock) {
+                sock->framesReceived++;
+                sock->vtbl->write(sock, zBuf, rawlen);
+                socketCheckBuffer(sock);
             }
-            sock->vtbl->write(sock, buf, ct);
-            free(buf);
-            break;
+            return hlen + len;
+        }
+    }
 
-        default:
-            fprintf(stderr, "Critical error! Unrecognized command %d!\n", (int) command);
-            return 1;
+    return -1;
+}
+
+/* read the remainder of a large 's' payload straight into the receiving
+ * socket's buffer, if it supports that. Returns 1 if it did */
+static int muxInputDirectRead(MuxInput *in, ssize_t *rd)
+{
+    struct iovec iov[MUX_INPUT_SIZE / CHUNK_DATA_SIZE + 2];
+    size_t count;
+    int iovcnt;
+    Socket *sock;
+
+    if (in->payloadLeft < MUX_DIRECT_MIN || in->start != in->end) return 0;
+    sock = socketById(in->payloadId);
+    if (!sock || !sock->vtbl->writeSpace) return 0;
+
+    count = in->payloadLeft;
+    if (count > MUX_INPUT_SIZE) count = MUX_INPUT_SIZE;
+    iovcnt = sock->vtbl->writeSpace(sock, iov, sizeof(iov) / sizeof(iov[0]), count);
+    *rd = in->transport->readv(in->transport, iov, iovcnt);
+    sock->vtbl->writeCommit(sock, (*rd > 0) ? *rd : 0);
+    if (*rd > 0) {
+        in->payloadLeft -= *rd;
+        in->ssuper.bytesRead += *rd;
+    }
+    socketCheckBuffer(sock);
+
+    return 1;
+}
+
+/* the other side is gone from an input channel */
+static int muxInputLost(MuxInput *in)
+{
+    if (in->channel)
+        fprintf(stderr, "Critical error! Lost channel %d!\n", in->channel);
+    else
+        fprintf(stderr, "Critical error! Lost stdin!\n");
+    return 1;
+}
+
+static int muxInputSelectedR(Socket *self, int fd)
+{
+    MuxInput *in = (MuxInput *) self;
+    ssize_t rd, used;
+    size_t part;
+    Socket *sock;
+
+    /* large payloads skip our buffer entirely */
+    if (muxInputDirectRead(in, &rd)) {
+        if (rd < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if (rd <= 0) return muxInputLost(in);
+        return 0;
+    }
+
+    /* move any partial frame header down to make room */
+    if (in->start) {
+        memmove(in->buf, in->buf + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+
+    rd = muxTransportRead(in->transport, in->buf + in->end, MUX_INPUT_SIZE - in->end);
+    if (rd < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (rd <= 0) return muxInputLost(in);
+    in->end += rd;
+    self->bytesRead += rd;
+
+    /* skip anything from before the other side's sync marker */
+    while (in->syncLen >= 0 && in->start < in->end) {
+        if (in->buf[in->start++] == MUX_SYNC[in->syncLen])
+            in->syncLen++;
+        else
+            in->syncLen = (in->buf[in->start - 1] == MUX_SYNC[0]);
+        if (in->syncLen == sizeof(MUX_SYNC) - 1)
+            in->syncLen = -1;
+    }
+
+    /* handle everything we have */
+    while (in->start < in->end) {
+        if (in->payloadLeft) {
+            /* deliver as much of the payload as we have */
+            part = in->end - in->start;
+            if (part > in->payloadLeft) part = in->payloadLeft;
+            sock = socketById(in->payloadId);
+            if (sock) {
+                sock->vtbl->write(sock, in->buf + in->start, part);
+                socketCheckBuffer(sock);
+            }
+            in->start += part;
+            in->payloadLeft -= part;
+            continue;
+        }
+
+        used = muxFrame(in, in->buf + in->start, in->end - in->start);
+        if (used < 0) return 1;
+        if (used == 0) break;
+        in->start += used;
     }
 
     return 0;
 }
 
-/* stdout */
-Socket *newStdoutSocket()
+/* an output channel */
+static MuxOutput *newMuxOutput(int channel)
 {
-    Socket *ret;
-    ret = newSocket(sizeof(SocketWritable));
-    newSocketWritable((SocketWritable *) ret, 1);
-    ret->vtbl = &stdoutVTbl;
+    MuxOutput *ret = (MuxOutput *) newSocket(sizeof(MuxOutput));
+    newSocketWritable((SocketWritable *) ret, muxTransports[channel]->wfd);
+    ret->ssuper.ssuper.vtbl = &muxOutputVTbl;
+    ret->transport = muxTransports[channel];
+    ret->channel = channel;
+    ret->blocked = 0;
+    initTimer(&ret->flushTimer, muxOutputFlush);
+    initTimer(&ret->pingTimer, muxOutputPing);
+    ret->markWhen = 0;
+    memset(&ret->queueDelay, 0, sizeof(Histogram));
+    memset(&ret->rtt, 0, sizeof(Histogram));
+    muxOut[channel] = (Socket *) ret;
     return ret;
 }
+
+/* stdout (or channel 0's other transport) */
+Socket *newStdoutSocket()
+{
+    return (Socket *) newMuxOutput(0);
+}
+
+/* select() for output channels, whose transport may want us to wait on a
+ * doorbell rather than for its FD to be writable */
+static void muxOutputShouldSelect(Socket *self, int *r, int *w)
+{
+    MuxOutput *out = (MuxOutput *) self;
+
+    *r = *w = -1;
+    if (((SocketWritable *) self)->wbuf.used == 0) return;
+    if (!out->transport->wfdBell)
+        *w = out->transport->wfd;
+    else if (out->blocked)
+        *r = out->transport->wfd;
+    else if (!out->flushTimer.when)
+        timerSet(&out->flushTimer, 1);
+}
+
+/* write what we can through the transport */
+static int muxOutputSelectedW(Socket *self, int fd)
+{
+    MuxOutput *out = (MuxOutput *) self;
+    SocketWritable *sockw = (SocketWritable *) self;
+    struct iovec iov[CHUNK_IOV_MAX];
+    ssize_t wrote;
+    int iovcnt;
+
+    iovcnt = chunkBufferIov(&sockw->wbuf, iov, CHUNK_IOV_MAX);
+    if (iovcnt) {
+        wrote = out->transport->writev(out->transport, iov, iovcnt);
+        if (wrote < 0) {
+            if (errno != EAGAIN && errno != EINTR) return 1;
+            wrote = 0;
+        }
+        chunkBufferSkip(&sockw->wbuf, wrote);
+        self->bytesWritten += wrote;
+        muxOutputWritten(self);
+    }
+
+    /* poll for whatever we now need (nothing, once it's all written) */
+    out->blocked = (sockw->wbuf.used > 0);
+    pollUpdate(self);
+
+    /* now there may be room for more */
+    schedRun(out->channel);
+    return 0;
+}
+
+/* write an output channel at the end of a wakeup */
+static void muxOutputFlush(Timer *timer)
+{
+    Socket *self = (Socket *) ((char *) timer - offsetof(MuxOutput, flushTimer));
+
+    if (muxOutputSelectedW(self, -1) != 0)
+        freeSocket(self);
+}
+
+/* send a ping with the time (in microseconds, wrapping around), for the
+ * other side to send back */
+static void muxOutputPing(Timer *timer)
+{
+    Socket *self = (Socket *) ((char *) timer - offsetof(MuxOutput, pingTimer));
+    long long now = timerNow();
+
+    muxCommand(self, 'p', (int32_t) (uint32_t) now);
+    timerSet(timer, now + (long long) muxPingInterval * 1000);
+}
+
+/* add a channel besides channel 0 (before the handshake) */
+int muxAddChannel(MuxTransport *transport)
+{
+    if (muxChannelsOpen == MUX_CHANNELS_MAX) return -1;
+    muxTransports[muxChannelsOpen++] = transport;
+    return 0;
+}
+
+/* start using the extra channels the handshake settled on */
+void initMuxChannels()
+{
+    MuxTransport *transport;
+    MuxInput *in;
+    MuxOutput *out;
+    char name[32];
+    int i;
+
+    for (i = 1; i < muxChannelsOpen; i++) {
+        transport = muxTransports[i];
+
+        /* the other side doesn't have this one */
+        if (i >= muxChannels) {
+            close(transport->rfd);
+            close(transport->wfd);
+            muxTransports[i] = NULL;
+            continue;
+        }
+
+        in = newMuxInput(i);
+        out = newMuxOutput(i);
+        snprintf(name, sizeof(name), "channel%d-in", i);
+        SF(in->ssuper.name, strdup, NULL, (name));
+        snprintf(name, sizeof(name), "channel%d-out", i);
+        SF(out->ssuper.ssuper.name, strdup, NULL, (name));
+        in->ssuper.local = out->ssuper.ssuper.local = 1;
+
+        registerSocket((Socket *) in, NULL);
+        registerSocket((Socket *) out, NULL);
+
+        /* everything before this is junk to the other side */
+        socketWritableWrite((Socket *) out, MUX_SYNC, sizeof(MUX_SYNC) - 1);
+    }
+
+    /* and ping on every channel, if the other side answers */
+    if (muxPingInterval && (muxPeerFeatures & MUX_FEATURE_PING)) {
+        for (i = 0; i < muxChannels; i++)
+            timerSet(&((MuxOutput *) muxOut[i])->pingTimer, timerNow() + 1);
+    }
+}
@@ -21,17 +21,93 @@
 #include <stdio.h>
 
 #include "muxsocket.h"
+#include "muxtransport.h"
 
 /* put an int into a char[4] */
 void muxPrepareInt(unsigned char *buf, int32_t i);
 
+/* the newest protocol version we speak. Version 1 has fixed 4-byte IDs and
+ * lengths and nothing but 'c', 'd' and 's'; version 2 has varint IDs and
+ * lengths, and adds 'w' and (if negotiated) 'z', 'p' and 'q' */
+#define MUX_VERSION 2
+
+/* the protocol version in use (the lower of ours and the other side's) */
+extern int muxVersion;
+
+/* each side may send this much on a stream before the other grants more
+ * with 'w' */
+#define MUX_WINDOW 262144
+
+/* the largest frame payload we accept */
+#define MUX_FRAME_MAX 65536
+
+/* feature bits, exchanged during the handshake */
+#define MUX_FEATURE_COMPRESS 1 /* willing to use 'z' frames */
+#define MUX_FEATURE_PING 2 /* answers 'p' (ping) frames with 'q' (pong) */
+
+/* the largest uncompressed payload of a 'z' frame */
+#define MUX_COMPRESS_MAX MUX_FRAME_MAX
+
+/* the features we offer, and those the other side offered */
+extern int muxFeatures, muxPeerFeatures;
+
+/* the largest frame payload and the per-stream window the other side
+ * accepts (without limit for version 1) */
+extern size_t muxPeerFrameMax, muxPeerWindow;
+
+/* the window we give the other side on each stream (MUX_WINDOW, unless a
+ * connection may buffer less) */
+extern size_t muxWindow;
+
+/* how often to ping the other side on each channel, in milliseconds (0 for
+ * never) */
+extern size_t muxPingInterval;
+
+/* the most channels (stdin/stdout and extras) we can use */
+#define MUX_CHANNELS_MAX 16
+
+/* the channels in use (as many as both sides have), and every channel's
+ * transport and input and output socket. Channel 0 is stdin/stdout, unless
+ * it's been given another transport */
+extern int muxChannels;
+extern MuxTransport *muxTransports[MUX_CHANNELS_MAX];
+extern Socket *muxIn[MUX_CHANNELS_MAX], *muxOut[MUX_CHANNELS_MAX];
+
+/* every frame for a stream goes on the same channel, so its order is kept.
+ * Each side allocates every other slot, hence the shift */
+#define MUX_CHANNEL(id) ((SOCKET_SLOT(id) >> 1) % muxChannels)
+#define MUX_OUT(id) (muxOut[MUX_CHANNEL(id)])
+
+/* how long the handshake took, in microseconds */
+extern long long muxHandshakeTime;
+
+/* perform the handshake on channel 0, negotiating the protocol */
+void muxHandshake(int preferredId);
+
+/* write out statistics */
+void muxStats(FILE *to);
+
 /* write out a command */
 void muxCommand(Socket *sock, char command, int32_t id);
 
+/* write out a command with an integer argument */
+void muxCommandInt(Socket *sock, char command, int32_t id, int32_t val);
+
+/* run channel 0 over another transport than stdin/stdout (before
+ * initSockets) */
+void muxUseTransport(MuxTransport *transport);
+
 /* create a stdin socket */
 Socket *newStdinSocket();
 
 /* create a stdout socket */
 Socket *newStdoutSocket();
 
+/* add a channel besides channel 0 (before the handshake). Returns -1 if
+ * there are too many */
+int muxAddChannel(MuxTransport *transport);
+
+/* start using the extra channels the handshake settled on */
+void initMuxChannels();
+
 #endif
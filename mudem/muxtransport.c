@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE /* for usleep */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "muxtransport.h"
+
+/* how long to wait for the other side to set up a UNIX socket or shared
+ * ring (in microseconds), and how often to look */
+#define TRANSPORT_WAIT 60000000
+#define TRANSPORT_WAIT_STEP 10000
+
+/* shared rings: the file starts with a header page, then has each side's
+ * ring (written by that side) */
+#define SHM_MAGIC "mudemshm"
+#define SHM_HEADER 4096
+#define SHM_SIZE_DEFAULT 1048576
+#define SHM_SIZE_MIN 4096
+
+/* one direction of a shared ring. head and tail only ever grow, and are
+ * kept apart so the reader and writer don't fight over a cache line. The
+ * reader sets dataWait before waiting on the data doorbell, the writer sets
+ * roomWait before waiting on the room doorbell, and whoever sees the other
+ * waiting rings for them. closed is set once either side is gone */
+typedef struct _ShmRing ShmRing;
+struct _ShmRing {
+    _Atomic uint64_t head;
+    char pad0[56];
+    _Atomic uint64_t tail;
+    char pad1[56];
+    atomic_int dataWait, roomWait, closed;
+    char pad2[52];
+};
+
+typedef struct _ShmHeader ShmHeader;
+struct _ShmHeader {
+    char magic[8];
+    uint64_t size;
+    char pad[48];
+    ShmRing rings[2];
+};
+
+/* a shared ring transport. The doorbells are FIFOs: we wait on inData and
+ * outRoom (which are rfd and wfd) and ring inRoom and outData */
+typedef struct _MuxTransportShm MuxTransportShm;
+struct _MuxTransportShm {
+    MuxTransport ssuper;
+    ShmRing *in, *out;
+    unsigned char *inBuf, *outBuf;
+    size_t size;
+    int inRoom, outData;
+};
+
+/* shared rings are marked closed when we exit, so the other side notices */
+static MuxTransportShm *shmTransports[16];
+static int shmTransportCount = 0;
+
+/* FD transports */
+static ssize_t fdReadv(MuxTransport *self, const struct iovec *iov, int iovcnt)
+{
+    return readv(self->rfd, iov, iovcnt);
+}
+
+static ssize_t fdWritev(MuxTransport *self, const struct iovec *iov, int iovcnt)
+{
+    return writev(self->wfd, iov, iovcnt);
+}
+
+static void setNonBlocking(int fd)
+{
+    int flags, tmpi;
+    SF(flags, fcntl, -1, (fd, F_GETFL, 0));
+    SF(tmpi, fcntl, -1, (fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+MuxTransport *newMuxTransportFd(int rfd, int wfd)
+{
+    MuxTransport *ret;
+
+    /* each FD is polled for one socket, so reading and writing need their
+     * own */
+    if (wfd == rfd) {
+        SF(wfd, dup, -1, (rfd));
+    }
+
+    SF(ret, malloc, NULL, (sizeof(MuxTransport)));
+    ret->name = "fd";
+    ret->rfd = rfd;
+    ret->wfd = wfd;
+    ret->wfdBell = 0;
+    ret->readv = fdReadv;
+    ret->writev = fdWritev;
+
+    setNonBlocking(rfd);
+    setNonBlocking(wfd);
+
+    return ret;
+}
+
+/* parse <fd>[,<fd>] */
+static MuxTransport *fdTransport(const char *spec, const char *arg)
+{
+    char *end;
+    long rfd, wfd;
+
+    rfd = strtol(arg, &end, 10);
+    wfd = rfd;
+    if (end != arg && *end == ',') {
+        arg = end + 1;
+        wfd = strtol(arg, &end, 10);
+    }
+    if (end == arg || *end || rfd < 0 || wfd < 0) {
+        fprintf(stderr, "Invalid transport %s.\n", spec);
+        exit(1);
+    }
+
+    return newMuxTransportFd(rfd, wfd);
+}
+
+/* UNIX socket transports, which are FD transports once connected */
+static MuxTransport *unixTransport(const char *spec, const char *path, int listening)
+{
+    struct sockaddr_un sun;
+    MuxTransport *ret;
+    int fd, lfd, tmpi, waited;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "Invalid transport %s.\n", spec);
+        exit(1);
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if (listening) {
+        SF(lfd, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+        unlink(path);
+        SF(tmpi, bind, -1, (lfd, (struct sockaddr *) &sun, sizeof(sun)));
+        SF(tmpi, listen, -1, (lfd, 1));
+        SF(fd, accept, -1, (lfd, NULL, NULL));
+        close(lfd);
+        unlink(path);
+
+    } else {
+        /* the other side may not be listening yet */
+        for (waited = 0; ; waited += TRANSPORT_WAIT_STEP) {
+            SF(fd, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+            if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0) break;
+            if ((errno != ENOENT && errno != ECONNREFUSED) || waited >= TRANSPORT_WAIT) {
+                perror(path);
+                exit(1);
+            }
+            close(fd);
+            usleep(TRANSPORT_WAIT_STEP);
+        }
+
+    }
+
+    ret = newMuxTransportFd(fd, fd);
+    ret->name = "unix";
+    return ret;
+}
+
+/* copy between a ring's buffer at position pos and a flat buffer */
+static void shmCopyOut(MuxTransportShm *self, uint64_t pos, void *buf, size_t count)
+{
+    size_t off = pos % self->size, part = self->size - off;
+    if (part > count) part = count;
+    memcpy(buf, self->inBuf + off, part);
+    memcpy((unsigned char *) buf + part, self->inBuf, count - part);
+}
+
+static void shmCopyIn(MuxTransportShm *self, uint64_t pos, const void *buf, size_t count)
+{
+    size_t off = pos % self->size, part = self->size - off;
+    if (part > count) part = count;
+    memcpy(self->outBuf + off, buf, part);
+    memcpy(self->outBuf, (const unsigned char *) buf + part, count - part);
+}
+
+/* ring a doorbell, or clear any rings */
+static void bellRing(int fd)
+{
+    char c = 0;
+    while (write(fd, &c, 1) < 0 && errno == EINTR);
+}
+
+static void bellClear(int fd)
+{
+    char buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR);
+}
+
+static ssize_t shmReadv(MuxTransport *self, const struct iovec *iov, int iovcnt)
+{
+    MuxTransportShm *shm = (MuxTransportShm *) self;
+    ShmRing *ring = shm->in;
+    uint64_t head, tail;
+    size_t avail, copied, part;
+    int i;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load(&ring->tail);
+    if (tail == head) {
+        if (atomic_load(&ring->closed)) return 0;
+
+        /* say we're waiting, then make sure nothing came in meanwhile */
+        bellClear(self->rfd);
+        atomic_store(&ring->dataWait, 1);
+        tail = atomic_load(&ring->tail);
+        if (tail == head) {
+            if (atomic_load(&ring->closed)) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+        atomic_store(&ring->dataWait, 0);
+    }
+
+    avail = tail - head;
+    copied = 0;
+    for (i = 0; i < iovcnt && copied < avail; i++) {
+        part = iov[i].iov_len;
+        if (part > avail - copied) part = avail - copied;
+        shmCopyOut(shm, head + copied, iov[i].iov_base, part);
+        copied += part;
+    }
+    atomic_store(&ring->head, head + copied);
+
+    /* the writer may be waiting for this room */
+    if (atomic_load(&ring->roomWait) && atomic_exchange(&ring->roomWait, 0))
+        bellRing(shm->inRoom);
+
+    /* and we want to hear of anything more, which may already be here */
+    if (copied == avail) {
+        atomic_store(&ring->dataWait, 1);
+        if (atomic_load(&ring->tail) != head + copied) bellRing(self->rfd);
+    } else {
+        bellRing(self->rfd);
+    }
+
+    return copied;
+}
+
+static ssize_t shmWritev(MuxTransport *self, const struct iovec *iov, int iovcnt)
+{
+    MuxTransportShm *shm = (MuxTransportShm *) self;
+    ShmRing *ring = shm->out;
+    uint64_t head, tail;
+    size_t room, copied, part, wanted;
+    int i;
+
+    if (atomic_load(&ring->closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load(&ring->head);
+    if (tail - head == shm->size) {
+        /* say we're waiting, then make sure no room was made meanwhile */
+        bellClear(self->wfd);
+        atomic_store(&ring->roomWait, 1);
+        head = atomic_load(&ring->head);
+        if (tail - head == shm->size) {
+            errno = EAGAIN;
+            return -1;
+        }
+        atomic_store(&ring->roomWait, 0);
+    }
+
+    room = shm->size - (tail - head);
+    copied = wanted = 0;
+    for (i = 0; i < iovcnt; i++) {
+        wanted += iov[i].iov_len;
+        if (copied == room) continue;
+        part = iov[i].iov_len;
+        if (part > room - copied) part = room - copied;
+        shmCopyIn(shm, tail + copied, iov[i].iov_base, part);
+        copied += part;
+    }
+    atomic_store(&ring->tail, tail + copied);
+
+    /* the reader may be waiting for this */
+    if (atomic_load(&ring->dataWait) && atomic_exchange(&ring->dataWait, 0))
+        bellRing(shm->outData);
+
+    /* if we're out of room, we want to hear when there's more, which there
+     * may already be */
+    if (copied < wanted) {
+        atomic_store(&ring->roomWait, 1);
+        if (atomic_load(&ring->head) != head) bellRing(self->wfd);
+    }
+
+    return copied;
+}
+
+/* mark every shared ring closed as we exit */
+static void shmExit()
+{
+    MuxTransportShm *shm;
+    int i;
+
+    for (i = 0; i < shmTransportCount; i++) {
+        shm = shmTransports[i];
+        atomic_store(&shm->in->closed, 1);
+        atomic_store(&shm->out->closed, 1);
+        bellRing(shm->outData);
+        bellRing(shm->inRoom);
+    }
+}
+
+/* open (after creating, on side 0) one of a shared ring's doorbells */
+static int shmBell(const char *path, const char *suffix, int side)
+{
+    char *bellPath;
+    int fd;
+
+    SF(bellPath, malloc, NULL, (strlen(path) + strlen(suffix) + 1));
+    sprintf(bellPath, "%s%s", path, suffix);
+
+    if (side == 0) {
+        unlink(bellPath);
+        SFE(fd, mkfifo, -1, bellPath, (bellPath, 0600));
+    }
+
+    /* (read-write, so it never blocks and never sees end-of-file) */
+    SFE(fd, open, -1, bellPath, (bellPath, O_RDWR | O_NONBLOCK));
+
+    /* the other side has it open too once it's ours */
+    if (side == 1) unlink(bellPath);
+
+    free(bellPath);
+    return fd;
+}
+
+/* shared ring transports. Side 0 creates the file (under a temporary name,
+ * so it only ever appears whole) and its doorbells; side 1 waits for them,
+ * then removes their names, so a stale file can't be picked up later */
+static MuxTransport *shmTransport(const char *spec, const char *arg, int side)
+{
+    MuxTransportShm *ret;
+    ShmHeader *header;
+    char *path, *tmpPath, *end;
+    unsigned long long size = SHM_SIZE_DEFAULT;
+    struct stat sbuf;
+    size_t len;
+    int fd, tmpi, waited;
+
+    SF(path, strdup, NULL, (arg));
+    end = strchr(path, ',');
+    if (end) {
+        *end++ = '\0';
+        size = strtoull(end, &end, 10);
+        if (*end) size = 0;
+    }
+    if (!path[0] || size < SHM_SIZE_MIN || size > ((size_t) -1 - SHM_HEADER) / 2) {
+        fprintf(stderr, "Invalid transport %s.\n", spec);
+        exit(1);
+    }
+    if (shmTransportCount == sizeof(shmTransports) / sizeof(shmTransports[0])) {
+        fprintf(stderr, "Too many shared transports.\n");
+        exit(1);
+    }
+
+    SF(ret, calloc, NULL, (1, sizeof(MuxTransportShm)));
+    ret->ssuper.name = "shm";
+    ret->ssuper.readv = shmReadv;
+    ret->ssuper.writev = shmWritev;
+    ret->ssuper.wfdBell = 1;
+
+    if (side == 0) {
+        /* the doorbells come first, so they're there once the file is */
+        ret->ssuper.rfd = shmBell(path, ".data1", 0);
+        ret->inRoom = shmBell(path, ".room1", 0);
+        ret->outData = shmBell(path, ".data0", 0);
+        ret->ssuper.wfd = shmBell(path, ".room0", 0);
+
+        SF(tmpPath, malloc, NULL, (strlen(path) + 5));
+        sprintf(tmpPath, "%s.new", path);
+        len = SHM_HEADER + 2 * size;
+        SFE(fd, open, -1, tmpPath, (tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0600));
+        SF(tmpi, ftruncate, -1, (fd, len));
+        SF(header, mmap, MAP_FAILED, (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        header->size = size;
+
+        /* neither reader has anything yet, so both want to hear of it */
+        atomic_store(&header->rings[0].dataWait, 1);
+        atomic_store(&header->rings[1].dataWait, 1);
+        memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+        SF(tmpi, rename, -1, (tmpPath, path));
+        free(tmpPath);
+
+    } else {
+        for (waited = 0; (fd = open(path, O_RDWR)) < 0; waited += TRANSPORT_WAIT_STEP) {
+            if (errno != ENOENT || waited >= TRANSPORT_WAIT) {
+                perror(path);
+                exit(1);
+            }
+            usleep(TRANSPORT_WAIT_STEP);
+        }
+
+        SF(tmpi, fstat, -1, (fd, &sbuf));
+        len = sbuf.st_size;
+        if (len < SHM_HEADER) {
+            fprintf(stderr, "%s is not a shared ring.\n", path);
+            exit(1);
+        }
+        SF(header, mmap, MAP_FAILED, (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        size = header->size;
+        if (memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) ||
+            size < SHM_SIZE_MIN || len != SHM_HEADER + 2 * size) {
+            fprintf(stderr, "%s is not a shared ring.\n", path);
+            exit(1);
+        }
+
+        ret->ssuper.rfd = shmBell(path, ".data0", 1);
+        ret->inRoom = shmBell(path, ".room0", 1);
+        ret->outData = shmBell(path, ".data1", 1);
+        ret->ssuper.wfd = shmBell(path, ".room1", 1);
+        unlink(path);
+
+    }
+    close(fd);
+
+    ret->size = size;
+    ret->in = &header->rings[!side];
+    ret->out = &header->rings[side];
+    ret->inBuf = (unsigned char *) header + SHM_HEADER + (!side) * size;
+    ret->outBuf = (unsigned char *) header + SHM_HEADER + side * size;
+
+    if (shmTransportCount == 0) atexit(shmExit);
+    shmTransports[shmTransportCount++] = ret;
+
+    free(path);
+    return (MuxTransport *) ret;
+}
+
+/* a transport from its description */
+MuxTransport *newMuxTransport(const char *spec, int side)
+{
+    if (spec[0] >= '0' && spec[0] <= '9') {
+        return fdTransport(spec, spec);
+    } else if (!strncmp(spec, "fd:", 3)) {
+        return fdTransport(spec, spec + 3);
+    } else if (!strncmp(spec, "unix:", 5) && spec[5]) {
+        return unixTransport(spec, spec + 5, 0);
+    } else if (!strncmp(spec, "unix-listen:", 12) && spec[12]) {
+        return unixTransport(spec, spec + 12, 1);
+    } else if (!strncmp(spec, "shm:", 4)) {
+        return shmTransport(spec, spec + 4, side);
+    }
+
+    fprintf(stderr, "Invalid transport %s.\n", spec);
+    exit(1);
+}
+
+/* read or write through a transport */
+ssize_t muxTransportRead(MuxTransport *self, void *buf, size_t count)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = count;
+    return self->readv(self, &iov, 1);
+}
+
+ssize_t muxTransportWrite(MuxTransport *self, const void *buf, size_t count)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) buf;
+    iov.iov_len = count;
+    return self->writev(self, &iov, 1);
+}
+
+/* wait until a read or write is worth trying again */
+int muxTransportWait(MuxTransport *self, int forWrite, long long usec)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = forWrite ? self->wfd : self->rfd;
+    pfd.events = (forWrite && !self->wfdBell) ? POLLOUT : POLLIN;
+    ret = poll(&pfd, 1, (usec < 0) ? -1 : (int) ((usec + 999) / 1000));
+    if (ret < 0 && errno != EINTR) {
+        perror("poll");
+        exit(1);
+    }
+
+    return ret > 0;
+}
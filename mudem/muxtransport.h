@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MUXTRANSPORT_H
+#define MUXTRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* what a mux channel runs over. Reads and writes never block (failing with
+ * EAGAIN instead), and after one has, polling rfd (for reading) or wfd tells
+ * us when to try again. wfd is polled for writing, unless wfdBell is set, in
+ * which case it's a doorbell polled for reading */
+typedef struct _MuxTransport MuxTransport;
+struct _MuxTransport {
+    const char *name;
+    int rfd, wfd, wfdBell;
+    ssize_t (*readv)(MuxTransport *self, const struct iovec *iov, int iovcnt);
+    ssize_t (*writev)(MuxTransport *self, const struct iovec *iov, int iovcnt);
+};
+
+/* a transport over a pair of FDs (which may be the same) */
+MuxTransport *newMuxTransportFd(int rfd, int wfd);
+
+/* a transport from its description, for the given side (0 or 1):
+ *  fd:<fd>[,<fd>] (or just <fd>[,<fd>]): read from the first FD, write to
+ *                                        the second
+ *  unix:<path>: connect to a UNIX socket
+ *  unix-listen:<path>: accept one connection on a UNIX socket
+ *  shm:<path>[,<size>]: a ring of size bytes each way in a file shared with
+ *                       the other side, with FIFOs beside it as doorbells
+ * Exits on failure */
+MuxTransport *newMuxTransport(const char *spec, int side);
+
+/* read or write through a transport */
+ssize_t muxTransportRead(MuxTransport *self, void *buf, size_t count);
+ssize_t muxTransportWrite(MuxTransport *self, const void *buf, size_t count);
+
+/* wait up to usec microseconds (forever if negative) until a read (or write,
+ * if forWrite) that failed with EAGAIN is worth trying again, returning 1 if
+ * it is */
+int muxTransportWait(MuxTransport *self, int forWrite, long long usec);
+
+#endif
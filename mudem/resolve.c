@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for getaddrinfo, strdup */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "resolve.h"
+
+/* how long resolutions are cached, in seconds */
+size_t resolveTTL = 60;
+
+/* a resolution for the resolver thread to do, and its result */
+typedef struct _ResolveJob ResolveJob;
+struct _ResolveJob {
+    ResolveJob *next;
+    Resolved *res;
+    struct addrinfo *ai;
+    int err;
+};
+
+/* every cache entry */
+static Resolved *resolvedHead;
+
+/* jobs for the resolver thread */
+static pthread_mutex_t jobsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobsCond = PTHREAD_COND_INITIALIZER;
+static ResolveJob *jobsHead, *jobsTail;
+
+/* the resolver thread sends finished jobs back through this pipe, to a
+ * socket of our own that reads them */
+static int jobsDone[2] = {-1, -1};
+
+/* vtbl for the finished-jobs socket */
+static void resolvedShouldSelect(Socket *self, int *r, int *w);
+static int resolvedSelectedR(Socket *self, int fd);
+
+static SocketVTbl resolvedVTbl = {
+    NULL, NULL, resolvedShouldSelect, resolvedSelectedR, NULL, NULL, NULL,
+    NULL
+};
+
+/* the resolver thread */
+static void *resolveThread(void *ignore)
+{
+    ResolveJob *job;
+    struct addrinfo hints;
+
+    while (1) {
+        pthread_mutex_lock(&jobsLock);
+        while (!jobsHead)
+            pthread_cond_wait(&jobsCond, &jobsLock);
+        job = jobsHead;
+        jobsHead = job->next;
+        if (!jobsHead) jobsTail = NULL;
+        pthread_mutex_unlock(&jobsLock);
+
+        /* only the (unchanging) host, port and family are ours to look at */
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = job->res->family;
+        hints.ai_socktype = SOCK_STREAM;
+        job->err = getaddrinfo(job->res->host, job->res->port, &hints, &job->ai);
+
+        /* (a pointer is written to a pipe atomically) */
+        while (write(jobsDone[1], &job, sizeof(job)) < 0 && errno == EINTR);
+    }
+
+    return NULL;
+}
+
+/* start the resolver thread */
+static void initResolve()
+{
+    pthread_t thread;
+    sigset_t mask, oldMask;
+    Socket *sock;
+    int tmpi;
+
+    SF(tmpi, pipe, -1, (jobsDone));
+    SF(tmpi, fcntl, -1, (jobsDone[0], F_SETFL, O_NONBLOCK));
+
+    /* signals are the loop's to handle */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &oldMask);
+    tmpi = pthread_create(&thread, NULL, resolveThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    if (tmpi != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(tmpi));
+        exit(1);
+    }
+    pthread_detach(thread);
+
+    /* it's ours alone, so the other side never hears of it */
+    sock = newSocket(sizeof(Socket));
+    sock->vtbl = &resolvedVTbl;
+    sock->local = 1;
+    registerSocket(sock, NULL);
+}
+
+/* start resolving an entry in the background */
+static void resolveStart(Resolved *res)
+{
+    ResolveJob *job;
+
+    if (res->resolving) return;
+    if (jobsDone[0] < 0) initResolve();
+    res->resolving = 1;
+
+    SF(job, malloc, NULL, (sizeof(ResolveJob)));
+    job->next = NULL;
+    job->res = res;
+    job->ai = NULL;
+    job->err = 0;
+
+    pthread_mutex_lock(&jobsLock);
+    if (jobsTail) jobsTail->next = job;
+    else jobsHead = job;
+    jobsTail = job;
+    pthread_cond_signal(&jobsCond);
+    pthread_mutex_unlock(&jobsLock);
+}
+
+/* take the addresses out of a getaddrinfo result */
+static void resolveSet(Resolved *res, struct addrinfo *ai)
+{
+    struct addrinfo *cur;
+    int i;
+
+    for (i = 0, cur = ai; cur; cur = cur->ai_next)
+        if (cur->ai_addrlen <= sizeof(struct sockaddr_storage)) i++;
+    if (i == 0) return;
+
+    free(res->addrs);
+    SF(res->addrs, malloc, NULL, (i * sizeof(ResolvedAddr)));
+    for (i = 0, cur = ai; cur; cur = cur->ai_next) {
+        if (cur->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        memcpy(&res->addrs[i].addr, cur->ai_addr, cur->ai_addrlen);
+        res->addrs[i].addrlen = cur->ai_addrlen;
+        i++;
+    }
+    res->naddrs = i;
+}
+
+/* get the cache entry for a host and port */
+Resolved *resolveHost(const char *host, const char *port, int family,
+                      void (*ready)(Socket *sock, Resolved *res))
+{
+    Resolved *res;
+    struct addrinfo hints, *ai;
+
+    for (res = resolvedHead; res; res = res->next) {
+        if (!strcmp(res->host, host) && !strcmp(res->port, port) &&
+            res->family == family && res->ready == ready)
+            return res;
+    }
+
+    SF(res, malloc, NULL, (sizeof(Resolved)));
+    SF(res->host, strdup, NULL, (host));
+    SF(res->port, strdup, NULL, (port));
+    res->family = family;
+    res->addrs = NULL;
+    res->naddrs = 0;
+    res->expires = 0;
+    res->resolving = 0;
+    INIT_BUFFER(res->waiting);
+    res->ready = ready;
+    res->next = resolvedHead;
+    resolvedHead = res;
+
+    /* numeric hosts need no looking up */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(host, port, &hints, &ai) == 0) {
+        resolveSet(res, ai);
+        freeaddrinfo(ai);
+        if (res->naddrs) {
+            res->expires = -1;
+            return res;
+        }
+    }
+
+    resolveStart(res);
+    return res;
+}
+
+/* get the addresses for a socket to connect to */
+int resolveGet(Resolved *res, Socket *sock)
+{
+    if (res->expires >= 0 && timerNow() >= res->expires)
+        resolveStart(res);
+
+    /* stale addresses are better than waiting */
+    if (res->naddrs) return 1;
+
+    resolveStart(res);
+    WRITE_ONE_BUFFER(res->waiting, sock);
+    return 0;
+}
+
+/* stop a socket waiting */
+void resolveCancel(Resolved *res, Socket *sock)
+{
+    size_t i;
+    for (i = 0; i < res->waiting.bufused; i++) {
+        if (res->waiting.buf[i] == sock) {
+            res->waiting.buf[i] = res->waiting.buf[--res->waiting.bufused];
+            return;
+        }
+    }
+}
+
+/* finish a job from the resolver thread */
+static void resolveFinish(ResolveJob *job)
+{
+    Resolved *res = job->res;
+    Socket *sock;
+
+    res->resolving = 0;
+    if (job->err == 0) {
+        resolveSet(res, job->ai);
+        freeaddrinfo(job->ai);
+        res->expires = timerNow() + (long long) resolveTTL * 1000000;
+    } else {
+        fprintf(stderr, "Failed to resolve %s: %s\n", res->host, gai_strerror(job->err));
+    }
+    free(job);
+
+    /* everyone waiting finds out (and may be freed, removing themselves) */
+    while (res->waiting.bufused) {
+        sock = res->waiting.buf[--res->waiting.bufused];
+        res->ready(sock, res);
+    }
+}
+
+/* select() for the finished-jobs socket */
+static void resolvedShouldSelect(Socket *self, int *r, int *w)
+{
+    *r = jobsDone[0];
+    *w = -1;
+}
+
+/* collect finished jobs */
+static int resolvedSelectedR(Socket *self, int fd)
+{
+    ResolveJob *jobs[64];
+    ssize_t rd;
+    int i;
+
+    rd = read(fd, jobs, sizeof(jobs));
+    if (rd <= 0) return 0;
+    for (i = 0; i < rd / (ssize_t) sizeof(ResolveJob *); i++)
+        resolveFinish(jobs[i]);
+
+    return 0;
+}
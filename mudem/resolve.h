@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "muxsocket.h"
+
+typedef struct _Resolved Resolved;
+typedef struct _ResolvedAddr ResolvedAddr;
+
+BUFFER(Socket, Socket *);
+
+struct _ResolvedAddr {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+/* a cached name resolution */
+struct _Resolved {
+    Resolved *next;
+    char *host, *port;
+    int family;
+
+    /* the addresses it resolved to (none if it never has), and when to
+     * resolve it again (in timerNow() time) */
+    ResolvedAddr *addrs;
+    int naddrs;
+    long long expires;
+
+    /* being resolved in the background */
+    int resolving;
+
+    /* sockets waiting for it to be resolved the first time, and what to
+     * call for each of them when it is (or fails) */
+    struct Buffer_Socket waiting;
+    void (*ready)(Socket *sock, Resolved *res);
+};
+
+/* how long resolutions are cached, in seconds */
+extern size_t resolveTTL;
+
+/* get the cache entry for a host and port, starting to resolve it in the
+ * background. Numeric hosts are resolved immediately, and never expire */
+Resolved *resolveHost(const char *host, const char *port, int family,
+                      void (*ready)(Socket *sock, Resolved *res));
+
+/* get the addresses for a socket to connect to. Returns 1 if there are some
+ * (refreshing them in the background if they've expired); otherwise the
+ * socket waits, and res->ready is called for it when there's an answer */
+int resolveGet(Resolved *res, Socket *sock);
+
+/* stop a socket waiting (because it's being destroyed) */
+void resolveCancel(Resolved *res, Socket *sock);
+
+#endif
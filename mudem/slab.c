@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* for posix_memalign */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "helpers.h"
+#include "slab.h"
+
+/* a slab: this header, then objects of one size class, the first of them one
+ * object's size in */
+typedef struct _Slab Slab;
+struct _Slab {
+    Slab *prev, *next;
+
+    /* freed objects, and where those never yet handed out start */
+    void *free;
+    char *fresh;
+
+    size_t used;
+};
+
+/* a size class: its slabs with room, the fullest roughly first */
+typedef struct _SlabClass SlabClass;
+struct _SlabClass {
+    Slab *head, *tail;
+    size_t slabs, empty, used;
+};
+
+static SlabClass classes[SLAB_CLASSES];
+
+/* statistics: allocations that called malloc (for slabs or large objects),
+ * and slabs freed */
+static unsigned long long slabMallocs, slabFrees;
+
+/* the size class for sz bytes, or -1 if it's too large for any */
+static int slabClass(size_t sz)
+{
+    int cls = 0;
+    size_t csz = SLAB_MIN;
+    while (csz < sz) {
+        csz *= 2;
+        cls++;
+    }
+    return (cls < SLAB_CLASSES) ? cls : -1;
+}
+
+/* is this slab full? */
+#define SLAB_FULL(slab) (!(slab)->free && (slab)->fresh == (char *) (slab) + SLAB_SIZE)
+
+/* take a slab out of its class's list */
+static void slabUnlink(SlabClass *class, Slab *slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else class->head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    else class->tail = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+/* put a slab at the start of its class's list */
+static void slabPush(SlabClass *class, Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = class->head;
+    if (class->head) class->head->prev = slab;
+    else class->tail = slab;
+    class->head = slab;
+}
+
+/* put a slab at the end of its class's list */
+static void slabAppend(SlabClass *class, Slab *slab)
+{
+    slab->next = NULL;
+    slab->prev = class->tail;
+    if (class->tail) class->tail->next = slab;
+    else class->head = slab;
+    class->tail = slab;
+}
+
+/* make a new, empty slab for a class */
+static Slab *newSlab(int cls)
+{
+    SlabClass *class = &classes[cls];
+    Slab *ret;
+    void *mem;
+    int err;
+
+    if ((err = posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE))) {
+        errno = err;
+        perror("posix_memalign");
+        exit(1);
+    }
+    ret = (Slab *) mem;
+    ret->free = NULL;
+    ret->fresh = (char *) mem + (SLAB_MIN << cls);
+    ret->used = 0;
+    slabPush(class, ret);
+    class->slabs++;
+    class->empty++;
+    slabMallocs++;
+    return ret;
+}
+
+/* allocate sz bytes from the slab of the smallest size class that fits */
+void *slabAlloc(size_t sz)
+{
+    int cls = slabClass(sz);
+    SlabClass *class;
+    Slab *slab;
+    void *ret;
+
+    if (cls < 0) {
+        slabMallocs++;
+        SF(ret, malloc, NULL, (sz));
+        return ret;
+    }
+    class = &classes[cls];
+
+    /* find a slab with room, or make one */
+    slab = class->head;
+    if (!slab) slab = newSlab(cls);
+    if (slab->used == 0) class->empty--;
+
+    /* take a freed object if there is one, otherwise a fresh one */
+    if (slab->free) {
+        ret = slab->free;
+        slab->free = *(void **) ret;
+    } else {
+        ret = slab->fresh;
+        slab->fresh += SLAB_MIN << cls;
+    }
+    slab->used++;
+    class->used++;
+
+    /* full slabs aren't kept track of until something in them is freed */
+    if (SLAB_FULL(slab))
+        slabUnlink(class, slab);
+
+    return ret;
+}
+
+/* free something from slabAlloc, given the size it was allocated with */
+void slabFree(void *ptr, size_t sz)
+{
+    int cls = slabClass(sz);
+    SlabClass *class;
+    Slab *slab;
+
+    if (cls < 0) {
+        free(ptr);
+        return;
+    }
+    class = &classes[cls];
+    slab = (Slab *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+
+    /* a slab that was full is now nearly so, so it's used first */
+    if (SLAB_FULL(slab))
+        slabPush(class, slab);
+
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    slab->used--;
+    class->used--;
+
+    /* empty slabs go last, or back to the heap if enough are kept already */
+    if (slab->used == 0) {
+        slabUnlink(class, slab);
+        if (class->empty >= SLAB_KEEP) {
+            class->slabs--;
+            slabFrees++;
+            free(slab);
+        } else {
+            class->empty++;
+            slabAppend(class, slab);
+        }
+    }
+}
+
+/* free every entirely free slab, even those normally kept */
+void slabReclaim()
+{
+    SlabClass *class;
+    Slab *slab;
+    int cls;
+
+    /* (empty slabs are always at the end) */
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        class = &classes[cls];
+        while ((slab = class->tail) && slab->used == 0) {
+            slabUnlink(class, slab);
+            class->slabs--;
+            class->empty--;
+            slabFrees++;
+            free(slab);
+        }
+    }
+}
+
+/* write out statistics */
+void slabStats(FILE *to)
+{
+    int cls;
+
+    fprintf(to, "# HELP mudem_slab_objects Objects allocated from slabs, by size class.\n"
+                "# TYPE mudem_slab_objects gauge\n");
+    for (cls = 0; cls < SLAB_CLASSES; cls++)
+        fprintf(to, "mudem_slab_objects{size=\"%d\"} %zu\n",
+                SLAB_MIN << cls, classes[cls].used);
+
+    fprintf(to, "# HELP mudem_slab_capacity_objects Objects that fit in the slabs held, by size class.\n"
+                "# TYPE mudem_slab_capacity_objects gauge\n");
+    for (cls = 0; cls < SLAB_CLASSES; cls++)
+        fprintf(to, "mudem_slab_capacity_objects{size=\"%d\"} %zu\n",
+                SLAB_MIN << cls,
+                classes[cls].slabs * (SLAB_SIZE / (SLAB_MIN << cls) - 1));
+
+    fprintf(to, "# HELP mudem_slab_slabs Slabs held, by size class.\n"
+                "# TYPE mudem_slab_slabs gauge\n");
+    for (cls = 0; cls < SLAB_CLASSES; cls++)
+        fprintf(to, "mudem_slab_slabs{size=\"%d\"} %zu\n",
+                SLAB_MIN << cls, classes[cls].slabs);
+
+    fprintf(to, "# HELP mudem_slab_mallocs_total Allocations that went to malloc, for slabs or large objects.\n"
+                "# TYPE mudem_slab_mallocs_total counter\n"
+                "mudem_slab_mallocs_total %llu\n"
+                "# HELP mudem_slab_frees_total Empty slabs given back to the heap.\n"
+                "# TYPE mudem_slab_frees_total counter\n"
+                "mudem_slab_frees_total %llu\n",
+            slabMallocs, slabFrees);
+}
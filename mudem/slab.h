@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* size (and alignment) of each slab */
+#define SLAB_SIZE 65536
+
+/* the smallest size class; each class is twice the last */
+#define SLAB_MIN 64
+
+/* how many size classes there are (64 to 4096 bytes). Anything larger comes
+ * straight from malloc */
+#define SLAB_CLASSES 7
+
+/* how many entirely free slabs each class keeps, rather than freeing them */
+#define SLAB_KEEP 4
+
+/* allocate sz bytes from the slab of the smallest size class that fits */
+void *slabAlloc(size_t sz);
+
+/* free something from slabAlloc, given the size it was allocated with */
+void slabFree(void *ptr, size_t sz);
+
+/* free every entirely free slab, even those normally kept */
+void slabReclaim();
+
+/* write out statistics */
+void slabStats(FILE *to);
+
+#endif
@@ -14,9 +14,10 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define _POSIX_SOURCE /* for strtok_r */
+#define _POSIX_C_SOURCE 200112L /* for strtok_r */
 
-#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,13 +26,17 @@
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 
+#include "helpers.h"
+#include "muxpoll.h"
 #include "muxsocket.h"
 #include "muxstdio.h"
+#include "resolve.h"
+#include "slab.h"
 
 /* types */
 typedef struct _SocketTCP4L SocketTCP4L;
 typedef struct _SocketTCP4C SocketTCP4C;
-typedef SocketWritable SocketTCP4;
+typedef struct _SocketTCP4 SocketTCP4;
 
 struct _SocketTCP4L {
     Socket ssuper;
@@ -40,8 +45,19 @@ struct _SocketTCP4L {
 
 struct _SocketTCP4C {
     Socket ssuper;
-    struct sockaddr *addr;
-    size_t addrlen;
+    Resolved *res;
+};
+
+struct _SocketTCP4 {
+    SocketWritable ssuper;
+
+    /* for outgoing connections, where to, and which address we're on (we
+     * try each in turn) */
+    Resolved *res;
+    int addr;
+
+    /* waiting for the host to be resolved */
+    int resolving;
 };
 
 /* vtbl for TCP4L */
@@ -50,30 +66,35 @@ static void tcp4lShouldSelect(Socket *self, int *r, int *w);
 static int tcp4lSelectedR(Socket *self, int fd);
 
 static SocketVTbl tcp4lVTbl = {
-    tcp4lDestruct, NULL, tcp4lShouldSelect, tcp4lSelectedR, NULL, NULL
+    tcp4lDestruct, NULL, tcp4lShouldSelect, tcp4lSelectedR, NULL, NULL, NULL,
+    NULL
 };
 
 /* vtbl for TCP4C */
 static Socket *tcp4cConnect(Socket *self);
 
 static SocketVTbl tcp4cVTbl = {
-    NULL, tcp4cConnect, NULL, NULL, NULL, NULL
+    NULL, tcp4cConnect, NULL, NULL, NULL, NULL, NULL, NULL
 };
 
 /* vtbl for TCP4 */
+static void tcp4Destruct(Socket *self);
+static void tcp4ShouldSelect(Socket *self, int *r, int *w);
+static int tcp4SelectedW(Socket *self, int fd);
+
 static SocketVTbl tcp4VTbl = {
-    socketWritableDestruct, NULL, socketWritableShouldSelectR, socketSelectedR,
-    socketWritableSelectedW, socketWritableWrite
+    tcp4Destruct, NULL, tcp4ShouldSelect, socketSelectedR, tcp4SelectedW,
+    socketWritableWrite, socketWritableWriteSpace, socketWritableWriteCommit
 };
 
 /* TCP4L nameable */
-static Socket *newTCP4L(char **saveptr);
+static Socket *newTCP4L(char **saveptr, SocketOptions *opts);
 static NameableSocket tcp4lN = {
     NULL, "tcp4-listen", newTCP4L
 };
 
 /* TCP4C nameable */
-static Socket *newTCP4C(char **saveptr);
+static Socket *newTCP4C(char **saveptr, SocketOptions *opts);
 static NameableSocket tcp4cN = {
     NULL, "tcp4", newTCP4C
 };
@@ -92,31 +113,108 @@ static void tcp4lShouldSelect(Socket *self, int *r, int *w)
     *w = -1;
 }
 
-/* accept a TCP4 connection */
+/* make a TCP4 socket of an accepted connection */
+static Socket *tcp4Accepted(int fd)
+{
+    SocketTCP4 *tcp4 = (SocketTCP4 *) newSocket(sizeof(SocketTCP4));
+    newSocketWritable((SocketWritable *) tcp4, fd);
+    tcp4->ssuper.ssuper.vtbl = &tcp4VTbl;
+    tcp4->res = NULL;
+    tcp4->resolving = 0;
+    return (Socket *) tcp4;
+}
+
+/* accept TCP4 connections */
 static int tcp4lSelectedR(Socket *self, int fd)
 {
-    SocketTCP4 *tcp4;
-    int newfd, id;
-    unsigned char idbuf[4];
+    socketAccept(self, fd, tcp4Accepted);
+    return 0;
+}
 
-    /* accept it */
-    newfd = accept(fd, NULL, NULL);
-    if (newfd < 0) return 0;
+/* destructor for TCP4 */
+static void tcp4Destruct(Socket *self)
+{
+    SocketTCP4 *tcp4 = (SocketTCP4 *) self;
+    if (tcp4->resolving)
+        resolveCancel(tcp4->res, self);
+    socketWritableDestruct(self);
+}
 
-    /* then make the return */
-    tcp4 = (SocketTCP4 *) newSocket(sizeof(SocketTCP4));
-    newSocketWritable(tcp4, newfd);
-    tcp4->ssuper.vtbl = &tcp4VTbl;
+/* select() for TCP4 (nothing, while we don't know where to connect) */
+static void tcp4ShouldSelect(Socket *self, int *r, int *w)
+{
+    if (((SocketTCP4 *) self)->resolving) {
+        *r = *w = -1;
+        return;
+    }
+    socketWritableShouldSelectR(self, r, w);
+}
 
-    /* register it */
-    id = registerSocket((Socket *) tcp4, NULL);
+/* replace a TCP4's fd with a fresh one (a failed connect leaves it unusable) */
+static void tcp4Reopen(SocketTCP4 *tcp4)
+{
+    SocketWritable *sockw = (SocketWritable *) tcp4;
+    int tmpi;
 
-    /* then tell the other side */
-    muxCommand(stdoutSocket, 'c', self->id);
-    muxPrepareInt(idbuf, id);
-    stdoutSocket->vtbl->write(stdoutSocket, idbuf, 4);
+    close(sockw->fd);
+    SF(sockw->fd, socket, -1, (tcp4->res->family, SOCK_STREAM, 0));
+    SF(tmpi, fcntl, -1, (sockw->fd, F_SETFL, O_NONBLOCK));
+    sockw->connecting = 0;
+}
 
-    return 0;
+/* start connecting to the next address there is, from tcp4->addr on.
+ * Returns -1 if we're out of addresses */
+static int tcp4Next(SocketTCP4 *tcp4)
+{
+    SocketWritable *sockw = (SocketWritable *) tcp4;
+    Resolved *res = tcp4->res;
+    ResolvedAddr *ra;
+
+    for (; tcp4->addr < res->naddrs; tcp4->addr++) {
+        ra = &res->addrs[tcp4->addr];
+        if (socketWritableConnect(sockw, (struct sockaddr *) &ra->addr, ra->addrlen) == 0) {
+            pollUpdate((Socket *) tcp4);
+            return 0;
+        }
+
+        tcp4Reopen(tcp4);
+    }
+
+    return -1;
+}
+
+/* selectedW for TCP4, which moves on to the next address if a connect fails */
+static int tcp4SelectedW(Socket *self, int fd)
+{
+    SocketTCP4 *tcp4 = (SocketTCP4 *) self;
+    SocketWritable *sockw = (SocketWritable *) self;
+    int err;
+    socklen_t errlen;
+
+    if (sockw->connecting && tcp4->res) {
+        errlen = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            return 1;
+        if (err) {
+            /* try the next address, on a fresh socket */
+            pollForget(self);
+            tcp4Reopen(tcp4);
+            tcp4->addr++;
+            return (tcp4Next(tcp4) < 0);
+        }
+    }
+
+    return socketWritableSelectedW(self, fd);
+}
+
+/* a host we were waiting for has been resolved (or not) */
+static void tcp4Resolved(Socket *self, Resolved *res)
+{
+    SocketTCP4 *tcp4 = (SocketTCP4 *) self;
+
+    tcp4->resolving = 0;
+    if (tcp4Next(tcp4) < 0)
+        freeSocket(self);
 }
 
 /* connection function for TCP4C */
@@ -124,27 +222,35 @@ static Socket *tcp4cConnect(Socket *self)
 {
     SocketTCP4C *sockc = (SocketTCP4C *) self;
     SocketTCP4 *ret;
-    int fd, tmpi;
+    int fd;
 
     /* make the socket */
     SF(fd, socket, -1, (AF_INET, SOCK_STREAM, 0));
+    ret = (SocketTCP4 *) newSocket(sizeof(SocketTCP4));
+    newSocketWritable((SocketWritable *) ret, fd);
+    ret->ssuper.ssuper.vtbl = &tcp4VTbl;
+    ret->res = sockc->res;
+    ret->addr = 0;
+    ret->resolving = 0;
+
+    /* if we don't know where it's going yet, data for it waits until we do */
+    if (!resolveGet(ret->res, (Socket *) ret)) {
+        ret->resolving = 1;
+        return (Socket *) ret;
+    }
 
-    tmpi = connect(fd, sockc->addr, sockc->addrlen);
-    if (tmpi < 0) {
-        close(fd);
+    /* otherwise, connect it in the background */
+    if (tcp4Next(ret) < 0) {
+        socketWritableDestruct((Socket *) ret);
+        slabFree(ret, sizeof(SocketTCP4));
         return NULL;
     }
 
-    /* then make the return */
-    ret = (SocketTCP4 *) newSocket(sizeof(SocketTCP4));
-    newSocketWritable(ret, fd);
-    ret->ssuper.vtbl = &tcp4VTbl;
-
     return (Socket *) ret;
 }
 
 /* create a new named TCP4L */
-static Socket *newTCP4L(char **saveptr)
+static Socket *newTCP4L(char **saveptr, SocketOptions *opts)
 {
     SocketTCP4L *ret;
     char *ports;
@@ -156,15 +262,16 @@ static Socket *newTCP4L(char **saveptr)
     if (ports == NULL) return NULL;
     port = atoi(ports);
 
-    /* make the socket */
-    SF(fd, socket, -1, (AF_INET, SOCK_STREAM, 0));
+    /* make the socket (non-blocking, as we accept until there's nothing
+     * left) */
+    SF(fd, socket, -1, (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
     sin.sin_family = AF_INET;
     sin.sin_port = htons(port);
     sin.sin_addr.s_addr = 0;
     SF(tmpi, bind, -1, (fd, (struct sockaddr *) &sin, sizeof(sin)));
 
     /* and set it up to listen */
-    SF(tmpi, listen, -1, (fd, 32));
+    SF(tmpi, listen, -1, (fd, opts->backlog));
 
     /* then make the return */
     ret = (SocketTCP4L *) newSocket(sizeof(SocketTCP4L));
@@ -175,12 +282,10 @@ static Socket *newTCP4L(char **saveptr)
 }
 
 /* create a new named TCP4C */
-static Socket *newTCP4C(char **saveptr)
+static Socket *newTCP4C(char **saveptr, SocketOptions *opts)
 {
     SocketTCP4C *ret;
     char *hosts, *ports;
-    struct addrinfo hints, *ai;
-    int tmpi;
 
     /* get the host and port */
     hosts = strtok_r(NULL, ":", saveptr);
@@ -192,15 +297,9 @@ static Socket *newTCP4C(char **saveptr)
     ret = (SocketTCP4C *) newSocket(sizeof(SocketTCP4C));
     ret->ssuper.vtbl = &tcp4cVTbl;
 
-    /* get the host */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    tmpi = getaddrinfo(hosts, ports, &hints, &ai);
-    if (tmpi != 0)
-        return NULL;
-    ret->addr = ai->ai_addr;
-    ret->addrlen = ai->ai_addrlen;
+    /* start looking up the host, so it's (probably) ready by the first
+     * connection */
+    ret->res = resolveHost(hosts, ports, AF_INET, tcp4Resolved);
 
     return (Socket *) ret;
 }
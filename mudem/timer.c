@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* for clock_gettime */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "timer.h"
+
+/* all set timers, in order of when they fire */
+static Timer *timersHead, *timersTail;
+
+/* initialize a timer (unset) */
+void initTimer(Timer *timer, void (*fire)(Timer *self))
+{
+    timer->prev = timer->next = NULL;
+    timer->when = 0;
+    timer->fire = fire;
+}
+
+/* the current monotonic time in microseconds */
+long long timerNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* set (or reset) a timer to fire at the given time */
+void timerSet(Timer *timer, long long when)
+{
+    Timer *after;
+
+    timerCancel(timer);
+    if (when <= 0) when = 1;
+    timer->when = when;
+
+    /* most timers are set a fixed delay from now, so search from the end */
+    for (after = timersTail; after && after->when > when; after = after->prev);
+
+    timer->prev = after;
+    if (after) {
+        timer->next = after->next;
+        after->next = timer;
+    } else {
+        timer->next = timersHead;
+        timersHead = timer;
+    }
+    if (timer->next)
+        timer->next->prev = timer;
+    else
+        timersTail = timer;
+}
+
+/* unset a timer, if it's set */
+void timerCancel(Timer *timer)
+{
+    if (!timer->when) return;
+
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        timersHead = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    else
+        timersTail = timer->prev;
+
+    timer->prev = timer->next = NULL;
+    timer->when = 0;
+}
+
+/* milliseconds until the next timer fires (rounded up), or -1 if none is
+ * set */
+int timerTimeout()
+{
+    long long left;
+
+    if (!timersHead) return -1;
+
+    left = timersHead->when - timerNow();
+    if (left <= 0) return 0;
+    return (int) ((left + 999) / 1000);
+}
+
+/* fire every timer that's due */
+void timerRun()
+{
+    long long now = timerNow();
+    Timer *timer;
+
+    while ((timer = timersHead) && timer->when <= now) {
+        timerCancel(timer);
+        timer->fire(timer);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2011 Gregor Richards
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+typedef struct _Timer Timer;
+
+/* a one-shot timer, usually embedded in whatever it's for */
+struct _Timer {
+    Timer *prev, *next;
+
+    /* when it fires, in timerNow() microseconds; 0 if it's not set */
+    long long when;
+
+    /* called when it fires (it's already unset by then) */
+    void (*fire)(Timer *self);
+};
+
+/* initialize a timer (unset) */
+void initTimer(Timer *timer, void (*fire)(Timer *self));
+
+/* the current monotonic time in microseconds */
+long long timerNow();
+
+/* set (or reset) a timer to fire at the given time */
+void timerSet(Timer *timer, long long when);
+
+/* unset a timer, if it's set */
+void timerCancel(Timer *timer);
+
+/* milliseconds until the next timer fires (rounded up), or -1 if none is
+ * set */
+int timerTimeout();
+
+/* fire every timer that's due */
+void timerRun();
+
+#endif
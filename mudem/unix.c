@@ -25,6 +25,7 @@
 
 #include "muxsocket.h"
 #include "muxstdio.h"
+#include "slab.h"
 
 /* types */
 typedef struct _SocketUNIXL SocketUNIXL;
@@ -48,30 +49,32 @@ static void unixlShouldSelect(Socket *self, int *r, int *w);
 static int unixlSelectedR(Socket *self, int fd);
 
 static SocketVTbl unixlVTbl = {
-    unixlDestruct, NULL, unixlShouldSelect, unixlSelectedR, NULL, NULL
+    unixlDestruct, NULL, unixlShouldSelect, unixlSelectedR, NULL, NULL, NULL,
+    NULL
 };
 
 /* vtbl for UNIXC */
 static Socket *unixcConnect(Socket *self);
 
 static SocketVTbl unixcVTbl = {
-    NULL, unixcConnect, NULL, NULL, NULL, NULL
+    NULL, unixcConnect, NULL, NULL, NULL, NULL, NULL, NULL
 };
 
 /* vtbl for UNIX */
 static SocketVTbl unixVTbl = {
     socketWritableDestruct, NULL, socketWritableShouldSelectR, socketSelectedR,
-    socketWritableSelectedW, socketWritableWrite
+    socketWritableSelectedW, socketWritableWrite, socketWritableWriteSpace,
+    socketWritableWriteCommit
 };
 
 /* UNIXL nameable */
-static Socket *newUNIXL(char **saveptr);
+static Socket *newUNIXL(char **saveptr, SocketOptions *opts);
 static NameableSocket unixlN = {
     NULL, "unix-listen", newUNIXL
 };
 
 /* UNIXC nameable */
-static Socket *newUNIXC(char **saveptr);
+static Socket *newUNIXC(char **saveptr, SocketOptions *opts);
 static NameableSocket unixcN = {
     NULL, "unix", newUNIXC
 };
@@ -90,30 +93,19 @@ static void unixlShouldSelect(Socket *self, int *r, int *w)
     *w = -1;
 }
 
-/* accept a UNIX connection */
-static int unixlSelectedR(Socket *self, int fd)
+/* make a UNIX socket of an accepted connection */
+static Socket *unixAccepted(int fd)
 {
-    SocketUNIX *sock;
-    int newfd, id;
-    unsigned char idbuf[4];
-
-    /* accept it */
-    newfd = accept(fd, NULL, NULL);
-    if (newfd < 0) return 0;
-
-    /* then make the return */
-    sock = (SocketUNIX *) newSocket(sizeof(SocketUNIX));
-    newSocketWritable(sock, newfd);
+    SocketUNIX *sock = (SocketUNIX *) newSocket(sizeof(SocketUNIX));
+    newSocketWritable(sock, fd);
     sock->ssuper.vtbl = &unixVTbl;
+    return (Socket *) sock;
+}
 
-    /* register it */
-    id = registerSocket((Socket *) sock, NULL);
-
-    /* then tell the other side */
-    muxCommand(stdoutSocket, 'c', self->id);
-    muxPrepareInt(idbuf, id);
-    stdoutSocket->vtbl->write(stdoutSocket, idbuf, 4);
-
+/* accept UNIX connections */
+static int unixlSelectedR(Socket *self, int fd)
+{
+    socketAccept(self, fd, unixAccepted);
     return 0;
 }
 
@@ -122,27 +114,26 @@ static Socket *unixcConnect(Socket *self)
 {
     SocketUNIXC *sockc = (SocketUNIXC *) self;
     SocketUNIX *ret;
-    int fd, tmpi;
+    int fd;
 
     /* make the socket */
     SF(fd, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
-
-    tmpi = connect(fd, sockc->addr, sockc->addrlen);
-    if (tmpi < 0) {
-        close(fd);
-        return NULL;
-    }
-
-    /* then make the return */
     ret = (SocketUNIX *) newSocket(sizeof(SocketUNIX));
     newSocketWritable(ret, fd);
     ret->ssuper.vtbl = &unixVTbl;
 
+    /* then connect it in the background */
+    if (socketWritableConnect(ret, sockc->addr, sockc->addrlen) < 0) {
+        socketWritableDestruct((Socket *) ret);
+        slabFree(ret, sizeof(SocketUNIX));
+        return NULL;
+    }
+
     return (Socket *) ret;
 }
 
 /* create a new named UNIXL */
-static Socket *newUNIXL(char **saveptr)
+static Socket *newUNIXL(char **saveptr, SocketOptions *opts)
 {
     SocketUNIXL *ret;
     char *path;
@@ -152,14 +143,15 @@ static Socket *newUNIXL(char **saveptr)
     /* get the path */
     path = strtok_r(NULL, "", saveptr);
 
-    /* make the socket */
-    SF(fd, socket, -1, (AF_UNIX, SOCK_STREAM, 0));
+    /* make the socket (non-blocking, as we accept until there's nothing
+     * left) */
+    SF(fd, socket, -1, (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0));
     sun.sun_family = AF_UNIX;
     strncpy(sun.sun_path, path, sizeof(sun.sun_path));
     SF(tmpi, bind, -1, (fd, (struct sockaddr *) &sun, sizeof(sun)));
 
     /* and set it up to listen */
-    SF(tmpi, listen, -1, (fd, 32));
+    SF(tmpi, listen, -1, (fd, opts->backlog));
 
     /* then make the return */
     ret = (SocketUNIXL *) newSocket(sizeof(SocketUNIXL));
@@ -170,7 +162,7 @@ static Socket *newUNIXL(char **saveptr)
 }
 
 /* create a new named UNIXC */
-static Socket *newUNIXC(char **saveptr)
+static Socket *newUNIXC(char **saveptr, SocketOptions *opts)
 {
     SocketUNIXC *ret;
     char *path;